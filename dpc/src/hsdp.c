@@ -19,6 +19,7 @@ SPDX-License-Identifier: MIT
 #include "hsdp_lib.h"
 
 #include "hsdp.h"
+#include "xvc_probe.h"
 
 #define DMA_DESC_OFFSET   0
 #define DMA_DESC_INGRESS(a) HSDP_AXI_ADDR(hsdp->idesc, a)
@@ -168,6 +169,17 @@ int hsdp_poll_fast_packet(hsdp_dma *hsdp, uint32_t **buf, size_t *word_count, hs
     int i = 0;
 #endif
 
+    XVC_PROBE(hsdp, poll__fast__packet__start);
+
+    // the last packet must be released before the next one is returned
+    if (hsdp->ehold >= 0) {
+        if (word_count) {
+            *word_count = 0;
+        }
+        XVC_PROBE2(hsdp, poll__fast__packet__done, 0, -1);
+        return 0;
+    }
+
     // find a done egress
     ie = HSDP_NEXT(hsdp->edesc);
     status = REG_EGRESS_DESC(ie, REG_DESC_STS);
@@ -211,23 +223,46 @@ int hsdp_poll_fast_packet(hsdp_dma *hsdp, uint32_t **buf, size_t *word_count, hs
         }
         iepkt = ie;
 
-        // resetup the egress desc
-        REG_EGRESS_DESC64(ie, REG_DESC_BUFF) = AXI_EGRESS_PACKET(iepkt);
-        REG_EGRESS_DESC(ie, REG_DESC_STS) = 0;
-
-        dsb(st);
-
-        // if (REG_EGRESS_DESC(ie, REG_DESC_STS) != 0) {
-        //     printf("Reg status not reset: 0x%08X\n", REG_EGRESS_DESC(ie, REG_DESC_STS));
-        // }
-
-        REG_DMA_EGRESS_TAIL64 = AXI_EGRESS_DESC(ie);
+        // the egress desc is set up again by hsdp_release_fast_packet()
+        // once the packet data is no longer used
+        hsdp->ehold = ie;
         hsdp->epkts.last = iepkt;
         hsdp->edesc.last = ie;
+
+        // an empty packet is not returned, so nothing will release it
+        if ((size >> 2) == 0) {
+            hsdp_release_fast_packet(hsdp);
+        }
     } else if (word_count) {
         *word_count = 0;
     }
 
+    XVC_PROBE2(hsdp, poll__fast__packet__done, size >> 2, status);
+    return 0;
+}
+
+
+int hsdp_release_fast_packet(hsdp_dma *hsdp) {
+    uint64_t dma_base = hsdp->dma_base;
+    int ie = hsdp->ehold;
+
+    if (ie < 0) {
+        return -1;
+    }
+
+    // resetup the egress desc
+    REG_EGRESS_DESC64(ie, REG_DESC_BUFF) = AXI_EGRESS_PACKET(ie);
+    REG_EGRESS_DESC(ie, REG_DESC_STS) = 0;
+
+    dsb(st);
+
+    // if (REG_EGRESS_DESC(ie, REG_DESC_STS) != 0) {
+    //     printf("Reg status not reset: 0x%08X\n", REG_EGRESS_DESC(ie, REG_DESC_STS));
+    // }
+
+    REG_DMA_EGRESS_TAIL64 = AXI_EGRESS_DESC(ie);
+    hsdp->ehold = -1;
+
     return 0;
 }
 
@@ -291,6 +326,8 @@ int hsdp_send_packet(hsdp_dma *hsdp, uint32_t *buf, size_t word_count) {
     int max_polls = 1000;
     size_t size = word_count * 4;
 
+    XVC_PROBE1(hsdp, send__packet__start, word_count);
+
     // if (REG_DMA_EGRESS_STS & 1) {
     //     printf("Last ingress %d\n", hsdp->last_ingress);
     //     set_last_error(hsdp, "DMA Halted.");
@@ -314,6 +351,7 @@ int hsdp_send_packet(hsdp_dma *hsdp, uint32_t *buf, size_t word_count) {
         set_last_error(hsdp, "No available ingress descriptors");
         // hsdp_dump_dma(hsdp);
         // exit(0);
+        XVC_PROBE2(hsdp, send__packet__done, word_count, -1);
         return -1;
     }
 
@@ -341,6 +379,7 @@ int hsdp_send_packet(hsdp_dma *hsdp, uint32_t *buf, size_t word_count) {
 
     hsdp->idesc.last = ii;
 
+    XVC_PROBE2(hsdp, send__packet__done, word_count, rv);
     return rv;
 }
 
@@ -400,6 +439,7 @@ void hsdp_setup_dma(hsdp_dma *hsdp) {
     hsdp->epkts.last = -1;
     hsdp->idesc.last = -1;
     hsdp->edesc.last = -1;
+    hsdp->ehold = -1;
 
     // reset
     REG_DMA_INGRESS_CNTL = 0x00010004;
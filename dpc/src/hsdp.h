@@ -36,6 +36,9 @@ typedef struct hsdp_dma {
     int error;
     unsigned char seq;
 
+    /* Egress descriptor whose packet is still in use, -1 if none */
+    int ehold;
+
 } hsdp_dma;
 
 struct SLDpcPacket;
@@ -91,6 +94,7 @@ int hsdp_send_packet(hsdp_dma *hsdp, uint32_t *buf, size_t word_count);
 int hsdp_send_fast_packet(hsdp_dma *hsdp, int buf_index, size_t size);
 int hsdp_poll_fast_packet(hsdp_dma *hsdp, uint32_t **buf, size_t *word_count, struct hsdp_packet **pkt);
 int hsdp_receive_fast_packet(hsdp_dma *hsdp, uint32_t **buf, size_t *word_count, struct hsdp_packet **pkt);
+int hsdp_release_fast_packet(hsdp_dma *hsdp);
 
 int hsdp_setup_packets(hsdp_dma *hsdp, int buf_index, int num_packets, size_t word_count);
 int hsdp_send_max_packets(hsdp_dma *hsdp);
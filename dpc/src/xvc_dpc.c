@@ -38,6 +38,7 @@ typedef struct {
     hsdp_dma *hsdp;
     mem_region dma;
     mem_region buf;
+    unsigned open_count;
 } xvc_dpc_t;
 
 LoggingMode log_mode = LOG_MODE_DEFAULT;
@@ -46,11 +47,17 @@ static const char * usage_text[] = {
   "Usage:\n Name      Description",
   "-------------------------------",
   "[--help]      Show help information",
-  "[-s]          Socket listening port and protocol.  Default: TCP::10200",
+  "[-s]          Socket listening port and protocol (tcp:, vsock:, unix: or shm:).  Default: TCP::10200",
   "[--dma_addr]  AXI DMA IP physical address.",
   "[--dma_size]  AXI DMA IP size in bytes.",
   "[--buf_addr]  Buffer physical address.",
   "[--buf_size]  Buffer size in bytes.",
+  "[--packet_len] Receive buffer size advertised to clients. Default: 10000",
+  "[--pipeline]  Execute commands on a separate hardware thread",
+  "[--io_uring]  Use io_uring for socket I/O when available",
+  "[--metrics]   Serve command statistics on [<host>:]<port>",
+  "[--trace_file] Flight recorder dump file.  Default: /tmp/xvcserver.<pid>.trace",
+  "[--capture]   Record every command batch and its reply to a file",
   "[--verbose]   Show additional messages during execution",
   "[--quiet]     Disable logging all non-error messages during execution",
   "\n",
@@ -66,6 +73,12 @@ static int open_port(void *client_data, XvcClient * c) {
 
     xvc_dpc->c = c;
 
+    // The DMA is set up once and shared by all open connections
+    if (xvc_dpc->open_count > 0) {
+        xvc_dpc->open_count++;
+        return ret;
+    }
+
     setup_dma_region(xvc_dpc->dma.addr, xvc_dpc->dma.size);
     setup_buffer_region(xvc_dpc->buf.addr, xvc_dpc->buf.size);
 
@@ -74,6 +87,8 @@ static int open_port(void *client_data, XvcClient * c) {
     if (!xvc_dpc->hsdp) {
         perror("ERROR: hsdp_open failed\n");
         ret = ERROR_HSDP_OPEN_FAILED;
+    } else {
+        xvc_dpc->open_count++;
     }
 
     return ret;
@@ -83,13 +98,26 @@ static void close_port(void *client_data) {
     int ret = 0;
     xvc_dpc_t* xvc_dpc = (xvc_dpc_t*)client_data;
 
+    if (xvc_dpc->open_count > 1) {
+        xvc_dpc->open_count--;
+        return;
+    }
+    xvc_dpc->open_count = 0;
+
     ret = hsdp_close((uint64_t) xvc_dpc->hsdp);
+    xvc_dpc->hsdp = NULL;
 
     if (ret) {
         fprintf(stderr, "Failed to close HSDP. Return value = %d\n", ret);
     }
 }
 
+static void select_port(void *client_data, XvcClient * c) {
+    xvc_dpc_t* xvc_dpc = (xvc_dpc_t*)client_data;
+
+    xvc_dpc->c = c;
+}
+
 static void idpc(
         void * client_data,
         unsigned flags,
@@ -140,6 +168,12 @@ static void edpc(
     }
 }
 
+static void edpc_release(void * client_data) {
+    xvc_dpc_t* xvc_dpc = (xvc_dpc_t*) client_data;
+
+    hsdp_release_fast_packet(xvc_dpc->hsdp);
+}
+
 static void display_banner() {
     fprintf(stdout, "\nDescription:\n");
     fprintf(stdout, "Xilinx xvc_dpc v%s\n", XVCDPC_VERSION);
@@ -167,7 +201,9 @@ XvcServerHandlers handlers = {
     NULL,
     NULL,
     idpc,
-    edpc
+    edpc,
+    select_port,
+    edpc_release
 };
 
 int main(int argc, char **argv)
@@ -178,8 +214,7 @@ int main(int argc, char **argv)
     int quiet = 0;
     int verbose = 0;
 
-    xvc_dpc.dma.size = 0;
-    xvc_dpc.buf.size = 0;
+    memset(&xvc_dpc, 0, sizeof xvc_dpc);
 
     while (i < argc && argv[i][0] == '-') {
         if (strcmp(argv[i], "-s") == 0) {
@@ -212,6 +247,35 @@ int main(int argc, char **argv)
                 return ERROR_INVALID_ARGUMENT;
             }
             xvc_dpc.buf.size = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--packet_len") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "option --packet_len requires an argument\n");
+                return ERROR_INVALID_ARGUMENT;
+            }
+            if (xvcserver_set_packet_len(strtoul(argv[++i], NULL, 0)) != NO_ERROR)
+                return ERROR_INVALID_ARGUMENT;
+        } else if (strcmp(argv[i], "--pipeline") == 0) {
+            xvcserver_set_pipeline(1);
+        } else if (strcmp(argv[i], "--io_uring") == 0) {
+            xvcserver_set_io_uring(1);
+        } else if (strcmp(argv[i], "--metrics") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "option --metrics requires an argument\n");
+                return ERROR_INVALID_ARGUMENT;
+            }
+            xvcserver_set_metrics(argv[++i]);
+        } else if (strcmp(argv[i], "--trace_file") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "option --trace_file requires an argument\n");
+                return ERROR_INVALID_ARGUMENT;
+            }
+            xvcserver_set_trace_file(argv[++i]);
+        } else if (strcmp(argv[i], "--capture") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "option --capture requires an argument\n");
+                return ERROR_INVALID_ARGUMENT;
+            }
+            xvcserver_set_capture_file(argv[++i]);
         } else if (strcmp(argv[i], "--verbose") == 0) {
             verbose = 1;
             if (quiet) {
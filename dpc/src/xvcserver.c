@@ -4,6 +4,7 @@ SPDX-License-Identifier: MIT
 */
 
 #define _CRT_SECURE_NO_WARNINGS 1
+#define _GNU_SOURCE
 
 #include <assert.h>
 #include <errno.h>
@@ -33,19 +34,70 @@ typedef unsigned __int8 uint8_t;
 #else
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/vm_sockets.h>
 #include <netinet/tcp.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <linux/errqueue.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/futex.h>
+#include <signal.h>
 
 #include <sys/time.h>
+#include <time.h>
 #endif
 
 #include "xvcserver.h"
+#include "xvc_probe.h"
 
 #define MAX_PACKET_LEN 10000
+#define MIN_PACKET_LEN 1024
+
+/* Largest packet length a client can ask for with configure:packet_len */
+#ifndef MAX_PACKET_LIMIT
+#define MAX_PACKET_LIMIT (8 * 1024 * 1024)
+#endif
+#define MAX_EPOLL_EVENTS 16
+
+/* Message queues of the pipelined mode.  A client has at most
+ * PIPELINE_CLIENT_MESSAGES messages in a queue at any time. */
+#define PIPELINE_QUEUE_LEN 256
+#define PIPELINE_CLIENT_MESSAGES 4
+#define PIPELINE_MAX_CLIENTS (PIPELINE_QUEUE_LEN / PIPELINE_CLIENT_MESSAGES)
+#define PIPELINE_REPLIES 2
+
+/* Submission queue size of the io_uring event loop */
+#define URING_ENTRIES 256
+
+/* Payload compression selected with configure:compress */
+#define COMPRESS_NONE 0
+#define COMPRESS_RLE 1
+
+/* Shortest run of equal bytes worth a run token, and most compressed
+ * reply vectors in one batch */
+#define RLE_MIN_RUN 4
+#define PACK_REGIONS 64
+
+/* Replies of at least this many bytes are sent with MSG_ZEROCOPY when
+ * the socket supports it.  0 disables zerocopy sends. */
+#ifndef ZEROCOPY_THRESHOLD
+#define ZEROCOPY_THRESHOLD 0
+#endif
+/* Word count, largest egress DPC packet and status */
+#define MAX_EDPC_REPLY_LEN 2048
 
 #define tostr2(X) #X
 #define tostr(X) tostr2(X)
@@ -55,34 +107,251 @@ typedef unsigned __int8 uint8_t;
 #define XVC_VERSION 11
 #endif
 
+/* Keep per command counters and latency histograms for stats: */
+#ifndef XVC_STATS
+#define XVC_STATS 1
+#endif
+#define STATS_COMMANDS 32
+#define STATS_TEXT_MAX 16384
+
+/* Keep the last TRACE_RECORDS commands for the flight recorder */
+#ifndef XVC_TRACE
+#define XVC_TRACE 1
+#endif
+#ifndef TRACE_RECORDS
+#define TRACE_RECORDS 4096
+#endif
+
+/* Session capture to the file set with xvcserver_set_capture_file() */
+#ifndef XVC_CAPTURE
+#define XVC_CAPTURE 1
+#endif
+
 static unsigned max_packet_len = MAX_PACKET_LEN;
+static int pipeline_enabled = 0;
+static int uring_enabled = 0;
+static char * metrics_addr = NULL;
+static unsigned connection_count = 0;
+static char * capture_path = NULL;
+
+/*
+ * Reply to a batch of commands: <len> bytes at <buf>, with <ext_len>
+ * bytes at <ext> sent after the first <ext_pos> of them.  <sent> counts
+ * the bytes already written to the socket.
+ */
+typedef struct {
+    unsigned len;
+    unsigned max;
+    size_t sent;
+    unsigned char * buf;
+    const unsigned char * ext;
+    size_t ext_len;
+    unsigned ext_pos;
+    void (*ext_release)(void * client_data);
+} XvcReply;
+
+typedef enum {
+    MSG_OPEN,           /* call open_port() */
+    MSG_DATA,           /* more bytes in the receive ring */
+    MSG_SENT,           /* reply sent, buffer handed back */
+    MSG_CLOSE,          /* call close_port() */
+    MSG_EXIT,           /* stop the hardware thread */
+    MSG_REPLY,          /* reply to send */
+    MSG_ERROR,          /* connection must be closed */
+    MSG_CLOSED          /* client can be freed */
+} XvcMessageType;
+
+typedef struct {
+    XvcMessageType type;
+    int sync;
+    XvcClient * c;
+    XvcReply reply;
+} XvcMessage;
+
+/*
+ * Lock-free single producer, single consumer message queue.  head is
+ * only written by the producer and tail only by the consumer.  The
+ * producer signals wake_fd when it adds a message to a queue the
+ * consumer has emptied, so a consumer that found the queue empty can
+ * sleep on wake_fd without missing a message.
+ */
+typedef struct {
+    XvcMessage msgs[PIPELINE_QUEUE_LEN];
+    unsigned head;
+    unsigned tail;
+    int wake_fd;
+} XvcQueue;
 
 struct XvcClient {
+    unsigned buf_start;
     unsigned buf_len;
     unsigned buf_max;
+    unsigned buf_size;
     uint8_t * buf;
+    unsigned buf_next_max;
+    unsigned buf_next_size;
+    uint8_t * buf_next;
+    XvcReply reply;
+    uint32_t events;
+    int zerocopy;
+    uint32_t zerocopy_sent;
+    uint32_t zerocopy_done;
     int fd;
     XvcServerHandlers *handlers;
     void *client_data;
     int enable_locking;
     int enable_status;
     char pending_error[1024];
+    /* Pipelined mode.  rx_head and closing are written by the network
+     * thread, rx_tail and the rest by the hardware thread. */
+    unsigned rx_head;
+    unsigned rx_tail;
+    unsigned rx_pos;
+    int kick;
+    int opened;
+    int dead;
+    int sync;
+    void (*sync_release)(void * client_data);
+    unsigned char * reply_spare;
+    unsigned reply_spare_max;
+    int closing;
+    unsigned tx_count;
+    XvcMessage tx[PIPELINE_REPLIES];
+    /* io_uring event loop */
+    unsigned uring_ops;
+    int recv_armed;
+    struct msghdr uring_msg;
+    struct iovec uring_iov[3];
+    /* Connection number in the flight recorder */
+    unsigned id;
+    /* shm: transport, NULL for socket connections */
+    XvcShmHeader * shm;
+    /* configure:compress.  The request vectors of a batch are unpacked
+     * one after the other into unpack_buf, so that a handler that
+     * defers its work until flush() still finds them, and the reply
+     * vectors listed in pack_pos/pack_len are packed after flush(). */
+    int compress;
+    unsigned char * unpack_buf;
+    unsigned unpack_max;
+    unsigned unpack_len;
+    unsigned pack_count;
+    unsigned pack_pos[PACK_REGIONS];
+    unsigned pack_len[PACK_REGIONS];
+    /* Commands of the current batch, by type */
+    uint32_t stats_mask;
+    unsigned stats_batch[STATS_COMMANDS];
+    XvcClient * next;
 };
 
-static XvcClient xvc_client;
+static XvcClient * clients = NULL;
+static int epoll_fd = -1;
 
-static unsigned char *reply_buf = NULL;
-static unsigned reply_max = 0;
-static unsigned reply_len;
+/* Network thread to hardware thread, and back */
+static XvcQueue hw_queue;
+static XvcQueue net_queue;
+static pthread_t hw_thread;
 
-static void reply_buf_size(unsigned bytes) {
-    if (reply_max < bytes) {
-        if (reply_max == 0) reply_max = 1;
-        while (reply_max < bytes) reply_max *= 2;
-        reply_buf = (unsigned char *)realloc(reply_buf, reply_max);
+/*
+ * io_uring instance used instead of epoll when enabled.  The rings are
+ * mapped from the kernel and driven with the raw system calls.
+ */
+typedef struct {
+    int fd;
+    unsigned * sq_head;
+    unsigned * sq_tail;
+    unsigned * sq_mask;
+    unsigned * sq_array;
+    struct io_uring_sqe * sqes;
+    unsigned * cq_head;
+    unsigned * cq_tail;
+    unsigned * cq_mask;
+    struct io_uring_cqe * cqes;
+    void * sq_ring;
+    size_t sq_ring_len;
+    void * cq_ring;
+    size_t cq_ring_len;
+    size_t sqes_len;
+    unsigned to_submit;
+    int multishot_accept;
+} XvcUring;
+
+/* Operation kinds, kept in the low bits of the user data next to the
+ * XvcClient pointer */
+#define URING_RECV 0
+#define URING_SEND 1
+#define URING_ACCEPT 2
+#define URING_OP_MASK 3
+
+static XvcUring uring;
+
+/* Shared memory segment of the shm: transport and its mirrored rings */
+typedef struct {
+    int fd;
+    char name[256];
+    XvcShmHeader * hdr;
+    size_t hdr_len;
+    uint8_t * req;
+    uint8_t * rep;
+} XvcShm;
+
+static XvcShm shm;
+
+static void reply_buf_size(XvcClient * c, unsigned bytes) {
+    if (c->reply.max < bytes) {
+        if (c->reply.max == 0) c->reply.max = 1;
+        while (c->reply.max < bytes) c->reply.max *= 2;
+        c->reply.buf = (unsigned char *)realloc(c->reply.buf, c->reply.max);
     }
 }
 
+/*
+ * Make room for <bytes> more reply bytes.  Returns 0 when the replies
+ * collected so far must be sent before the next command is executed.
+ */
+static int reply_room(XvcClient * c, size_t bytes) {
+    if (c->reply.len + bytes <= c->reply.max) return 1;
+    if (c->reply.len > 0) return 0;
+    reply_buf_size(c, bytes);
+    return 1;
+}
+
+/*
+ * Add <len> bytes at <data> to the reply without copying them.  The
+ * bytes follow what is already in reply_buf and are sent straight from
+ * <data>.  <release> is called once the send has completed.
+ */
+static void reply_extern(XvcClient * c, const unsigned char * data, size_t len,
+                         void (*release)(void * client_data)) {
+    assert(c->reply.ext == NULL);
+    c->reply.ext = data;
+    c->reply.ext_len = len;
+    c->reply.ext_pos = c->reply.len;
+    c->reply.ext_release = release;
+}
+
+/*
+ * Returns 1 while the next batch of commands must wait.  That is while
+ * the reply is being sent, or in pipelined mode while the hardware
+ * thread has no free reply buffer or waits for a reply that refers to
+ * external memory or resizes the receive ring.
+ */
+static int reply_pending(XvcClient * c) {
+    if (pipeline_enabled)
+        return c->sync || c->reply.buf == NULL;
+    return c->reply.sent < c->reply.len + c->reply.ext_len ||
+        c->zerocopy_done != c->zerocopy_sent;
+}
+
+static void reply_release(XvcClient * c) {
+    if (c->reply.ext_release)
+        c->reply.ext_release(c->client_data);
+    c->reply.ext = NULL;
+    c->reply.ext_len = 0;
+    c->reply.ext_release = NULL;
+    c->reply.len = 0;
+    c->reply.sent = 0;
+}
+
 static char *get_field(char **sp, int c) {
     char *field = *sp;
     char *s = field;
@@ -94,6 +363,396 @@ static char *get_field(char **sp, int c) {
     return field;
 }
 
+/*
+ * Command decoder.  command_names[] is sorted so that names with the
+ * same first character are adjacent, and command_first[] maps a first
+ * character to its group.  Decoding a command is one table lookup and
+ * a compare against the few names of that group.
+ */
+typedef enum {
+    CMD_UNKNOWN,
+    CMD_CAPABILITIES,
+    CMD_CONFIGURE,
+    CMD_EDPC,
+    CMD_ERROR,
+    CMD_GETINFO,
+    CMD_IDPC,
+    CMD_STATS
+} XvcCommand;
+
+typedef struct {
+    const char * name;
+    unsigned len;
+    XvcCommand cmd;
+} XvcCommandName;
+
+#define COMMAND_NAME(name, cmd) { name, sizeof(name) - 1, cmd }
+
+static const XvcCommandName command_names[] = {
+    COMMAND_NAME("capabilities:", CMD_CAPABILITIES),
+    COMMAND_NAME("configure:", CMD_CONFIGURE),
+    COMMAND_NAME("edpc:", CMD_EDPC),
+    COMMAND_NAME("error:", CMD_ERROR),
+    COMMAND_NAME("getinfo:", CMD_GETINFO),
+    COMMAND_NAME("idpc:", CMD_IDPC),
+    COMMAND_NAME("stats:", CMD_STATS),
+};
+
+#define COMMAND_COUNT (sizeof command_names / sizeof command_names[0])
+
+static unsigned char command_first[256];
+
+static void init_commands(void) {
+    unsigned i = COMMAND_COUNT;
+
+    while (i-- > 0) {
+        assert(i + 1 == COMMAND_COUNT || command_names[i].name[0] <= command_names[i + 1].name[0]);
+        command_first[(unsigned char)command_names[i].name[0]] = i + 1;
+    }
+    assert(COMMAND_COUNT < STATS_COMMANDS);
+}
+
+/*
+ * Decode the command name at <name>, <len> bytes including the ':'.
+ */
+static XvcCommand decode_command(const unsigned char * name, unsigned len) {
+    unsigned i = command_first[name[0]];
+
+    if (i-- == 0) return CMD_UNKNOWN;
+    for (; i < COMMAND_COUNT && (unsigned char)command_names[i].name[0] == name[0]; i++) {
+        if (command_names[i].len == len &&
+                memcmp(command_names[i].name + 1, name + 1, len - 1) == 0)
+            return command_names[i].cmd;
+    }
+    return CMD_UNKNOWN;
+}
+
+#if XVC_STATS || XVC_TRACE
+/* Name of command <cmd> without the ':' */
+static const char * command_name(unsigned cmd, unsigned * len) {
+    unsigned i;
+
+    for (i = 0; i < COMMAND_COUNT; i++) {
+        if (command_names[i].cmd == cmd) {
+            *len = command_names[i].len - 1;
+            return command_names[i].name;
+        }
+    }
+    *len = 7;
+    return "unknown";
+}
+#endif
+
+#if XVC_STATS || XVC_TRACE || XVC_CAPTURE
+static uint64_t stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#else
+static uint64_t stats_now(void) {
+    return 0;
+}
+#endif
+
+#if XVC_STATS
+/*
+ * Command statistics.  Each command type has byte and command counters
+ * and two latency histograms: the time to execute the command, which
+ * is mostly the handler callback, and the time from the start of its
+ * batch until the reply of the batch is handed to the transport.  The
+ * counters are only written by the thread that executes commands and
+ * are read by stats: and by the metrics thread, so plain relaxed
+ * atomic loads and stores are enough.
+ *
+ * The histograms are log-linear like HdrHistogram: 2^STATS_SUB_BITS
+ * buckets for each power of two nanoseconds, so a percentile is within
+ * 1/16 of the recorded value.
+ */
+#define STATS_SUB_BITS 4
+#define STATS_MAX_BITS 40
+#define STATS_BUCKETS ((STATS_MAX_BITS - STATS_SUB_BITS + 1) << STATS_SUB_BITS)
+
+#define STATS_GET(var) __atomic_load_n(&(var), __ATOMIC_RELAXED)
+#define STATS_ADD(var, n) __atomic_store_n(&(var), (var) + (n), __ATOMIC_RELAXED)
+
+typedef struct {
+    uint64_t count;
+    uint64_t max;
+    uint64_t buckets[STATS_BUCKETS];
+} XvcHistogram;
+
+typedef struct {
+    uint64_t commands;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    XvcHistogram hw;
+    XvcHistogram total;
+} XvcCommandStats;
+
+static XvcCommandStats command_stats[STATS_COMMANDS];
+
+/* Payload bytes before and after compression, received and sent */
+typedef struct {
+    uint64_t raw;
+    uint64_t packed;
+} XvcCompressStats;
+
+static XvcCompressStats compress_stats[2];
+
+
+static unsigned stats_bucket(uint64_t ns) {
+    unsigned shift;
+
+    if (ns >> STATS_MAX_BITS) ns = ((uint64_t)1 << STATS_MAX_BITS) - 1;
+    if (ns < (1 << STATS_SUB_BITS)) return ns;
+    shift = 63 - __builtin_clzll(ns) - STATS_SUB_BITS;
+    return ((shift + 1) << STATS_SUB_BITS) + ((ns >> shift) & ((1 << STATS_SUB_BITS) - 1));
+}
+
+/* Largest value that falls in bucket <b> */
+static uint64_t stats_bucket_value(unsigned b) {
+    unsigned shift;
+
+    if (b < (1 << STATS_SUB_BITS)) return b;
+    shift = (b >> STATS_SUB_BITS) - 1;
+    return ((uint64_t)((1 << STATS_SUB_BITS) + (b & ((1 << STATS_SUB_BITS) - 1))) << shift) +
+        ((uint64_t)1 << shift) - 1;
+}
+
+static void stats_record(XvcHistogram * h, uint64_t ns, unsigned count) {
+    STATS_ADD(h->buckets[stats_bucket(ns)], count);
+    STATS_ADD(h->count, count);
+    if (ns > h->max)
+        __atomic_store_n(&h->max, ns, __ATOMIC_RELAXED);
+}
+
+static uint64_t stats_percentile(XvcHistogram * h, unsigned permille) {
+    uint64_t count = STATS_GET(h->count);
+    uint64_t target = (count * permille + 999) / 1000;
+    uint64_t sum = 0;
+    unsigned b;
+
+    if (count == 0) return 0;
+    for (b = 0; b < STATS_BUCKETS; b++) {
+        sum += STATS_GET(h->buckets[b]);
+        if (sum >= target) break;
+    }
+    if (b == STATS_BUCKETS || stats_bucket_value(b) > STATS_GET(h->max))
+        return STATS_GET(h->max);
+    return stats_bucket_value(b);
+}
+
+static void stats_count(XvcClient * c, XvcCommand cmd, size_t in, size_t out, uint64_t ns) {
+    XvcCommandStats * s = command_stats + cmd;
+
+    STATS_ADD(s->commands, 1);
+    STATS_ADD(s->bytes_in, in);
+    STATS_ADD(s->bytes_out, out);
+    stats_record(&s->hw, ns, 1);
+    if (c->stats_batch[cmd]++ == 0)
+        c->stats_mask |= 1u << cmd;
+}
+
+static void stats_compress(int sent, size_t raw, size_t packed) {
+    STATS_ADD(compress_stats[sent].raw, raw);
+    STATS_ADD(compress_stats[sent].packed, packed);
+}
+
+/* The reply to the batch that started at <start> has been handed off */
+static void stats_batch(XvcClient * c, uint64_t start) {
+    uint64_t ns = stats_now() - start;
+
+    while (c->stats_mask) {
+        unsigned cmd = __builtin_ctz(c->stats_mask);
+        c->stats_mask &= c->stats_mask - 1;
+        stats_record(&command_stats[cmd].total, ns, c->stats_batch[cmd]);
+        c->stats_batch[cmd] = 0;
+    }
+}
+
+/*
+ * Write the statistics of the commands seen so far to <buf> in the
+ * Prometheus text format.  Returns the length, truncated to fit.
+ */
+static unsigned stats_format(char * buf, size_t size) {
+    static const struct {
+        const char * name;
+        unsigned permille;
+    } quantiles[] = { { "0.5", 500 }, { "0.9", 900 }, { "0.99", 990 }, { "1", 1000 } };
+    size_t pos = 0;
+    unsigned metric;
+
+    buf[0] = '\0';
+    for (metric = 0; metric < 5; metric++) {
+        unsigned cmd;
+        for (cmd = 0; cmd < STATS_COMMANDS && pos < size; cmd++) {
+            XvcCommandStats * s = command_stats + cmd;
+            const char * name;
+            unsigned len;
+            unsigned q;
+
+            if (STATS_GET(s->commands) == 0) continue;
+            name = command_name(cmd, &len);
+            switch (metric) {
+            case 0:
+                pos += snprintf(buf + pos, size - pos, "xvc_commands_total{command=\"%.*s\"} %llu\n",
+                                (int)len, name, (unsigned long long)STATS_GET(s->commands));
+                break;
+            case 1:
+                pos += snprintf(buf + pos, size - pos, "xvc_received_bytes_total{command=\"%.*s\"} %llu\n",
+                                (int)len, name, (unsigned long long)STATS_GET(s->bytes_in));
+                break;
+            case 2:
+                pos += snprintf(buf + pos, size - pos, "xvc_sent_bytes_total{command=\"%.*s\"} %llu\n",
+                                (int)len, name, (unsigned long long)STATS_GET(s->bytes_out));
+                break;
+            default:
+                for (q = 0; q < sizeof quantiles / sizeof quantiles[0] && pos < size; q++)
+                    pos += snprintf(buf + pos, size - pos, "xvc_%s_latency_ns{command=\"%.*s\",quantile=\"%s\"} %llu\n",
+                                    metric == 3 ? "hw" : "total", (int)len, name, quantiles[q].name,
+                                    (unsigned long long)stats_percentile(metric == 3 ? &s->hw : &s->total,
+                                                                         quantiles[q].permille));
+                break;
+            }
+        }
+    }
+    for (metric = 0; metric < 2 && pos < size; metric++) {
+        XvcCompressStats * s = compress_stats + metric;
+        const char * direction = metric ? "sent" : "received";
+        uint64_t packed = STATS_GET(s->packed);
+
+        if (packed == 0) continue;
+        pos += snprintf(buf + pos, size - pos,
+                        "xvc_compressed_bytes_total{direction=\"%s\"} %llu\n"
+                        "xvc_uncompressed_bytes_total{direction=\"%s\"} %llu\n"
+                        "xvc_compression_ratio{direction=\"%s\"} %.2f\n",
+                        direction, (unsigned long long)packed,
+                        direction, (unsigned long long)STATS_GET(s->raw),
+                        direction, (double)STATS_GET(s->raw) / packed);
+    }
+    return pos < size ? pos : size - 1;
+}
+#else
+static void stats_count(XvcClient * c, XvcCommand cmd, size_t in, size_t out, uint64_t ns) {
+}
+
+static void stats_compress(int sent, size_t raw, size_t packed) {
+}
+
+static void stats_batch(XvcClient * c, uint64_t start) {
+}
+
+static unsigned stats_format(char * buf, size_t size) {
+    buf[0] = '\0';
+    return 0;
+}
+#endif
+
+/*
+ * Flight recorder.  The last TRACE_RECORDS commands of all connections
+ * are kept in a ring that is only written by the thread executing
+ * commands.  trace_dump() makes async-signal-safe calls only, so it
+ * also runs from the SIGUSR1 handler.
+ */
+static char trace_path[256];
+
+#if XVC_TRACE
+static XvcTraceRecord trace_ring[TRACE_RECORDS];
+static uint64_t trace_total;
+static char trace_names[STATS_COMMANDS * 16];
+static unsigned trace_names_len;
+
+static void trace_record(XvcClient * c, XvcCommand cmd, size_t in, size_t out, uint64_t now, uint64_t ns) {
+    XvcTraceRecord * r = trace_ring + trace_total % TRACE_RECORDS;
+
+    r->time = now;
+    r->duration = ns < UINT32_MAX ? ns : UINT32_MAX;
+    r->bytes_in = in;
+    r->bytes_out = out;
+    r->client = c->id;
+    r->command = cmd;
+    r->error = c->pending_error[0] != '\0';
+    __atomic_store_n(&trace_total, trace_total + 1, __ATOMIC_RELEASE);
+}
+
+static void trace_dump(void) {
+    uint64_t total = __atomic_load_n(&trace_total, __ATOMIC_ACQUIRE);
+    unsigned count = total < TRACE_RECORDS ? total : TRACE_RECORDS;
+    unsigned first = (total - count) % TRACE_RECORDS;
+    unsigned part = count < TRACE_RECORDS - first ? count : TRACE_RECORDS - first;
+    XvcTraceHeader h;
+    int fd;
+
+    if (trace_path[0] == '\0') return;
+    fd = open(trace_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return;
+    memset(&h, 0, sizeof h);
+    h.magic = XVC_TRACE_MAGIC;
+    h.version = 1;
+    h.record_size = sizeof(XvcTraceRecord);
+    h.count = count;
+    h.names_len = trace_names_len;
+    h.total = total;
+    if (write(fd, &h, sizeof h) == sizeof h &&
+            write(fd, trace_names, trace_names_len) == trace_names_len &&
+            write(fd, trace_ring + first, part * sizeof(XvcTraceRecord)) == part * sizeof(XvcTraceRecord) &&
+            count > part)
+        write(fd, trace_ring, (count - part) * sizeof(XvcTraceRecord));
+    close(fd);
+}
+
+static void trace_signal(int sig) {
+    int err = errno;
+    trace_dump();
+    errno = err;
+}
+
+static void trace_start(LoggingMode log_mode) {
+    struct sigaction sa;
+    unsigned cmd;
+
+    trace_names_len = 0;
+    for (cmd = 0; cmd <= COMMAND_COUNT; cmd++) {
+        unsigned len;
+        const char * name = command_name(cmd, &len);
+        memcpy(trace_names + trace_names_len, name, len);
+        trace_names_len += len;
+        trace_names[trace_names_len++] = '\n';
+    }
+    if (trace_path[0] == '\0')
+        snprintf(trace_path, sizeof trace_path, "/tmp/xvcserver.%d.trace", (int)getpid());
+
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = trace_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+    if (log_mode == LOG_MODE_VERBOSE)
+        fprintf(stdout, "INFO: Send SIGUSR1 to write the flight recorder to %s\n", trace_path);
+}
+#else
+static void trace_dump(void) {
+}
+
+static void trace_start(LoggingMode log_mode) {
+}
+#endif
+
+/*
+ * Account command <cmd> that took <in> request bytes and <out> reply
+ * bytes.  <last> is when the previous command of the batch completed.
+ */
+static void stats_command(XvcClient * c, XvcCommand cmd, size_t in, size_t out, uint64_t * last) {
+    uint64_t now = stats_now();
+
+    stats_count(c, cmd, in, out, now - *last);
+#if XVC_TRACE
+    trace_record(c, cmd, in, out, now, now - *last);
+#endif
+    *last = now;
+}
+
 #ifndef _WIN32
 static int closesocket(int sock)
 {
@@ -139,6 +798,77 @@ static int open_server(const char * host, const char * port) {
     return sock;
 }
 
+static int bind_server(int family, struct sockaddr * addr, socklen_t addr_len) {
+    int sock = socket(family, SOCK_STREAM, 0);
+
+    if (sock < 0) return -1;
+    if (bind(sock, addr, addr_len) || listen(sock, 4)) {
+        int err = errno;
+        closesocket(sock);
+        errno = err;
+        return -1;
+    }
+    return sock;
+}
+
+static int open_unix_server(const char * path) {
+    struct sockaddr_un addr;
+    struct stat st;
+
+    if (strlen(path) >= sizeof addr.sun_path) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    /* Remove the socket left behind by a previous server */
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+
+    return bind_server(AF_UNIX, (struct sockaddr *)&addr, sizeof addr);
+}
+
+/*
+ * Listen on AF_VSOCK port <port> of context <cid>, any context when
+ * <cid> is empty.  Lets a server in a virtual machine be reached from
+ * the host without a virtual NIC.
+ */
+static int open_vsock_server(const char * cid, const char * port) {
+    struct sockaddr_vm addr;
+    char * end = NULL;
+
+    memset(&addr, 0, sizeof addr);
+    addr.svm_family = AF_VSOCK;
+    addr.svm_cid = VMADDR_CID_ANY;
+    if (*cid != '\0') {
+        addr.svm_cid = strtoul(cid, &end, 0);
+        if (*end != '\0') {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    addr.svm_port = strtoul(port, &end, 0);
+    if (*port == '\0' || *end != '\0') {
+        errno = EINVAL;
+        return -1;
+    }
+    return bind_server(AF_VSOCK, (struct sockaddr *)&addr, sizeof addr);
+}
+
+static unsigned vsock_local_cid(void) {
+    unsigned cid = VMADDR_CID_ANY;
+    int fd = open("/dev/vsock", O_RDONLY);
+
+    if (fd >= 0) {
+        if (ioctl(fd, IOCTL_VM_SOCKETS_GET_LOCAL_CID, &cid) < 0)
+            cid = VMADDR_CID_ANY;
+        close(fd);
+    }
+    return cid;
+}
+
 static size_t get_uleb128(unsigned char** buf, void *bufend) {
     unsigned char * p = (unsigned char *)*buf;
     size_t value = 0;
@@ -155,27 +885,204 @@ static size_t get_uleb128(unsigned char** buf, void *bufend) {
 }
 
 static void reply_status(XvcClient * c) {
-    if (reply_len < max_packet_len)
-        reply_buf[reply_len] = (c->pending_error[0] != '\0');
-    reply_len++;
+    if (c->reply.len < c->reply.max)
+        c->reply.buf[c->reply.len] = (c->pending_error[0] != '\0');
+    c->reply.len++;
 }
 
-static void reply_uleb128(unsigned value) {
+static void reply_uleb128(XvcClient * c, unsigned value) {
     unsigned pos = 0;
     do {
-        if (reply_len + pos < max_packet_len) {
+        if (c->reply.len + pos < c->reply.max) {
             if (value >= 0x80) {
-                reply_buf[reply_len + pos] = (value & 0x7f) | 0x80;
+                c->reply.buf[c->reply.len + pos] = (value & 0x7f) | 0x80;
             } else {
-                reply_buf[reply_len + pos] = value & 0x7f;
+                c->reply.buf[c->reply.len + pos] = value & 0x7f;
             }
         }
         value >>= 7;
         pos++;
     } while (value);
-    reply_len += pos;
+    c->reply.len += pos;
+}
+
+/*
+ * RLE payload compression.  A compressed vector is a sequence of
+ * tokens, each a ULEB128 header <h> followed by data: <h>/2 literal
+ * bytes when <h> is even, or one byte repeated <h>/2 times when <h> is
+ * odd.  The tokens end when the length of the vector, which the
+ * receiver knows from the command, has been produced.
+ */
+static unsigned char * pack_uleb128(unsigned char * p, uint64_t value) {
+    do {
+        *p++ = (value >= 0x80 ? 0x80 : 0) | (value & 0x7f);
+        value >>= 7;
+    } while (value);
+    return p;
+}
+
+static unsigned char * rle_literal(unsigned char * out, const unsigned char * in, size_t len) {
+    if (len == 0) return out;
+    out = pack_uleb128(out, len * 2);
+    memcpy(out, in, len);
+    return out + len;
+}
+
+/*
+ * Pack the <len> bytes at <in> into <out>, which must have room for
+ * RLE_PACKED_MAX(<len>) bytes.  Returns the packed length.
+ */
+#define RLE_PACKED_MAX(len) ((len) + (len) / 64 + 8)
+
+static size_t rle_pack(const unsigned char * in, size_t len, unsigned char * out) {
+    unsigned char * o = out;
+    size_t lit = 0;
+    size_t i = 0;
+
+    while (i < len) {
+        size_t run = 1;
+        while (i + run < len && in[i + run] == in[i])
+            run++;
+        if (run >= RLE_MIN_RUN) {
+            o = rle_literal(o, in + lit, i - lit);
+            o = pack_uleb128(o, run * 2 + 1);
+            *o++ = in[i];
+            lit = i + run;
+        }
+        i += run;
+    }
+    return rle_literal(o, in + lit, len - lit) - out;
+}
+
+static void unpack_buf_size(XvcClient * c, unsigned bytes) {
+    if (c->unpack_max < bytes) {
+        if (c->unpack_max == 0) c->unpack_max = 1;
+        while (c->unpack_max < bytes) c->unpack_max *= 2;
+        c->unpack_buf = (unsigned char *)realloc(c->unpack_buf, c->unpack_max);
+    }
 }
 
+#if XVC_VERSION >= 11
+/* The <len> reply bytes at <pos> are packed once the batch is flushed */
+static void pack_region(XvcClient * c, unsigned pos, unsigned len) {
+    if (!c->compress) return;
+    c->pack_pos[c->pack_count] = pos;
+    c->pack_len[c->pack_count] = len;
+    c->pack_count++;
+}
+#endif
+
+/*
+ * Replace the reply with its packed form.  The unpacked request
+ * vectors are no longer needed after flush(), so the packed reply is
+ * built in unpack_buf and the two buffers are swapped.
+ */
+static void pack_reply(XvcClient * c) {
+    unsigned char * out;
+    unsigned char * old;
+    unsigned old_max;
+    size_t packed;
+    size_t len = 0;
+    unsigned pos = 0;
+    unsigned i;
+
+    if (c->pack_count == 0) return;
+    unpack_buf_size(c, RLE_PACKED_MAX(c->reply.len) + 8 * c->pack_count);
+    out = c->unpack_buf;
+    for (i = 0; i < c->pack_count; i++) {
+        memcpy(out + len, c->reply.buf + pos, c->pack_pos[i] - pos);
+        len += c->pack_pos[i] - pos;
+        packed = rle_pack(c->reply.buf + c->pack_pos[i], c->pack_len[i], out + len);
+        stats_compress(1, c->pack_len[i], packed);
+        len += packed;
+        pos = c->pack_pos[i] + c->pack_len[i];
+    }
+    memcpy(out + len, c->reply.buf + pos, c->reply.len - pos);
+    len += c->reply.len - pos;
+
+    old = c->reply.buf;
+    old_max = c->reply.max;
+    c->reply.buf = out;
+    c->reply.max = c->unpack_max;
+    c->reply.len = len;
+    c->unpack_buf = old;
+    c->unpack_max = old_max;
+    c->pack_count = 0;
+}
+
+#if XVC_VERSION >= 11
+/*
+ * Unpack a vector of <len> bytes at *<buf> into <out> and move *<buf>
+ * past it.  Returns 1 when done, 0 when the vector does not end before
+ * <bufend> and -1 when it is malformed.
+ */
+static int rle_unpack(unsigned char ** buf, unsigned char * bufend, unsigned char * out, size_t len) {
+    unsigned char * p = *buf;
+
+    while (len > 0) {
+        uint64_t h = get_uleb128(&p, bufend);
+        size_t n = h >> 1;
+        if (bufend < p) return 0;
+        if (n == 0 || n > len) return -1;
+        if (h & 1) {
+            if (p == bufend) return 0;
+            memset(out, *p++, n);
+        } else {
+            if ((size_t)(bufend - p) < n) return 0;
+            memcpy(out, p, n);
+            p += n;
+        }
+        out += n;
+        len -= n;
+    }
+    *buf = p;
+    return 1;
+}
+
+/*
+ * Make room for <bytes> more unpacked request bytes.  Returns 0 when
+ * the batch must end first, since the vectors unpacked so far may
+ * still be used by the handlers, and -1 when the vectors are longer
+ * than an uncompressed command could be.
+ */
+static int unpack_room(XvcClient * c, size_t bytes) {
+    if (bytes > c->buf_max) {
+        fprintf(stderr, "protocol error: compressed vectors longer than packet_len\n");
+        return -1;
+    }
+    if (c->unpack_len + bytes <= c->unpack_max) return 1;
+    if (c->unpack_len > 0) return 0;
+    unpack_buf_size(c, bytes);
+    return 1;
+}
+
+/*
+ * Unpack the next request vector of <len> bytes after the ones already
+ * unpacked in this batch, which must have room for it.  Returns 1 when
+ * done, 0 when more input is needed and -1 on a protocol error.
+ */
+static int unpack_vector(XvcClient * c, unsigned char ** p, unsigned char * cbuf, unsigned char * cend,
+                         size_t len) {
+    unsigned char * start = *p;
+    int r = rle_unpack(p, cend, c->unpack_buf + c->unpack_len, len);
+
+    if (r < 0) {
+        fprintf(stderr, "protocol error: malformed compressed vector\n");
+        return -1;
+    }
+    if (r == 0) {
+        if (cend - cbuf >= c->buf_max) {
+            fprintf(stderr, "protocol error: compressed command longer than packet_len\n");
+            return -1;
+        }
+        return 0;
+    }
+    c->unpack_len += len;
+    stats_compress(0, len, *p - start);
+    return 1;
+}
+#endif
+
 void xvcserver_set_error(XvcClient * c, const char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
@@ -184,15 +1091,275 @@ void xvcserver_set_error(XvcClient * c, const char *fmt, ...) {
     va_end(ap);
 }
 
-static int send_packet(XvcClient * c, const void * buf, unsigned len) {
-    int rval = send(c->fd, buf, len, 0);
-    return rval;
+static int watch_client(XvcClient * c, uint32_t events) {
+    struct epoll_event ev;
+
+    if (c->events == events) return 0;
+    memset(&ev, 0, sizeof ev);
+    ev.events = events;
+    ev.data.ptr = c;
+    c->events = events;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+static int reply_iov_add(struct iovec * iov, const unsigned char * data, size_t len, size_t * skip) {
+    if (*skip >= len) {
+        *skip -= len;
+        return 0;
+    }
+    iov->iov_base = (void *)(data + *skip);
+    iov->iov_len = len - *skip;
+    *skip = 0;
+    return 1;
+}
+
+/*
+ * Describe the part of the reply that is not sent yet: reply_buf up to
+ * the external data, the external data itself and the rest of
+ * reply_buf.
+ */
+static int reply_iovec(XvcReply * r, struct iovec * iov) {
+    size_t skip = r->sent;
+    unsigned pos = r->ext ? r->ext_pos : r->len;
+    int n = 0;
+
+    n += reply_iov_add(iov + n, r->buf, pos, &skip);
+    if (r->ext)
+        n += reply_iov_add(iov + n, r->ext, r->ext_len, &skip);
+    n += reply_iov_add(iov + n, r->buf + pos, r->len - pos, &skip);
+    return n;
+}
+
+/*
+ * Collect MSG_ZEROCOPY completion notifications from the socket error
+ * queue.  Buffers handed to a zerocopy send must not be reused or
+ * released until its notification has arrived.
+ */
+static int zerocopy_complete(XvcClient * c) {
+#if ZEROCOPY_THRESHOLD > 0
+    for (;;) {
+        char control[128];
+        struct msghdr msg;
+        struct cmsghdr * cm;
+
+        memset(&msg, 0, sizeof msg);
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof control;
+        if (recvmsg(c->fd, &msg, MSG_ERRQUEUE) < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            struct sock_extended_err * serr = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                  (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+                continue;
+            if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                return -1;
+            c->zerocopy_done += serr->ee_data - serr->ee_info + 1;
+        }
+    }
+#else
+    return -1;
+#endif
+}
+
+/*
+ * Send the pending part of reply <r> with sendmsg().  Stops early when
+ * the socket cannot take more.
+ */
+static int send_reply(XvcClient * c, XvcReply * r) {
+    size_t total = r->len + r->ext_len;
+
+    while (r->sent < total) {
+        struct iovec iov[3];
+        struct msghdr msg;
+        int flags = MSG_NOSIGNAL;
+        ssize_t rval;
+
+        memset(&msg, 0, sizeof msg);
+        msg.msg_iov = iov;
+        msg.msg_iovlen = reply_iovec(r, iov);
+#if ZEROCOPY_THRESHOLD > 0
+        if (c->zerocopy && total - r->sent >= ZEROCOPY_THRESHOLD)
+            flags |= MSG_ZEROCOPY;
+#endif
+        rval = sendmsg(c->fd, &msg, flags);
+        if (rval < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+#if ZEROCOPY_THRESHOLD > 0
+            /* Memory that cannot be pinned, like a /dev/mem mapping,
+             * or no room for the notification: copy instead */
+            if ((errno == EFAULT || errno == ENOBUFS) && (flags & MSG_ZEROCOPY)) {
+                rval = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+                flags = 0;
+            }
+#endif
+            if (rval < 0) {
+                trace_dump();
+                return -1;
+            }
+        }
+#if ZEROCOPY_THRESHOLD > 0
+        if (flags & MSG_ZEROCOPY) c->zerocopy_sent++;
+#endif
+        XVC_PROBE2(xvcserver, send, c->id, rval);
+        r->sent += rval;
+    }
+    return 0;
+}
+
+static int uring_send(XvcClient * c);
+static int shm_send(XvcClient * c);
+
+/*
+ * Send the reply.  When the socket cannot take all of it the client is
+ * switched to wait for EPOLLOUT and the rest is sent from the event
+ * loop.  With io_uring the send is only queued here.
+ */
+static int send_packet(XvcClient * c) {
+    if (c->shm != NULL) return shm_send(c);
+    if (uring_enabled) return uring_send(c);
+    if (send_reply(c, &c->reply) < 0) return -1;
+    if (c->reply.sent < c->reply.len + c->reply.ext_len)
+        return watch_client(c, EPOLLOUT);
+    return watch_client(c, c->zerocopy_done != c->zerocopy_sent ? 0 : EPOLLIN);
+}
+
+/*
+ * The receive buffer is a ring of <buf_size> bytes mapped twice back
+ * to back, so a command that wraps around the end of the ring is still
+ * contiguous in memory and is parsed in place.  Consumed bytes are
+ * dropped by advancing buf_start and are never copied.
+ */
+static uint8_t * ring_map(int fd, off_t offset, unsigned bytes) {
+    uint8_t * addr;
+
+    addr = (uint8_t *)mmap(NULL, 2 * (size_t)bytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) return NULL;
+    if (mmap(addr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, offset) == MAP_FAILED ||
+        mmap(addr + bytes, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, offset) == MAP_FAILED) {
+        munmap(addr, 2 * (size_t)bytes);
+        return NULL;
+    }
+    return addr;
+}
+
+static uint8_t * ring_alloc(unsigned * size) {
+    long page = sysconf(_SC_PAGESIZE);
+    unsigned bytes = (*size + page - 1) / page * page;
+    uint8_t * addr;
+    int fd;
+
+    fd = memfd_create("xvc_ring", MFD_CLOEXEC);
+    if (fd < 0) return NULL;
+    if (ftruncate(fd, bytes) < 0) {
+        close(fd);
+        return NULL;
+    }
+    addr = ring_map(fd, 0, bytes);
+    close(fd);
+    if (addr == NULL) return NULL;
+    *size = bytes;
+    return addr;
+}
+
+static void ring_free(uint8_t * buf, unsigned size) {
+    if (buf != NULL)
+        munmap(buf, 2 * (size_t)size);
 }
 
 static void consume_packet(XvcClient * c, unsigned len) {
     assert(len <= c->buf_len);
     c->buf_len -= len;
-    memmove(c->buf, c->buf + len, c->buf_len);
+    c->buf_start = (c->buf_start + len) % c->buf_size;
+    if (pipeline_enabled)
+        __atomic_store_n(&c->rx_tail, c->rx_tail + len, __ATOMIC_RELEASE);
+    else if (c->shm != NULL)
+        __atomic_store_n(&c->shm->req_tail, c->shm->req_tail + len, __ATOMIC_RELEASE);
+}
+
+/*
+ * shm: transport: the request ring holds what the client has written
+ * and the server has not consumed yet.
+ */
+static int shm_receive(XvcClient * c) {
+    c->buf_len = __atomic_load_n(&c->shm->req_head, __ATOMIC_ACQUIRE) - c->shm->req_tail;
+    if (c->buf_len > c->buf_size) {
+        fprintf(stderr, "protocol error: request ring overrun\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Switch to the receive buffer allocated by configure:packet_len.  The
+ * commands received after the configure: are moved to the new ring.
+ */
+static void resize_packet(XvcClient * c) {
+    memcpy(c->buf_next, c->buf + c->buf_start, c->buf_len);
+    ring_free(c->buf, c->buf_size);
+    c->buf = c->buf_next;
+    c->buf_size = c->buf_next_size;
+    c->buf_max = c->buf_next_max;
+    c->buf_start = 0;
+    c->buf_next = NULL;
+}
+
+static void queue_put(XvcQueue * q, XvcMessage * m) {
+    unsigned head = q->head;
+    uint64_t one = 1;
+
+    assert(head - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) < PIPELINE_QUEUE_LEN);
+    q->msgs[head % PIPELINE_QUEUE_LEN] = *m;
+    __atomic_store_n(&q->head, head + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&q->tail, __ATOMIC_SEQ_CST) == head &&
+            write(q->wake_fd, &one, sizeof one) < 0)
+        perror("ERROR: eventfd write failed");
+}
+
+static int queue_get(XvcQueue * q, XvcMessage * m) {
+    unsigned tail = q->tail;
+
+    if (__atomic_load_n(&q->head, __ATOMIC_SEQ_CST) == tail) return 0;
+    *m = q->msgs[tail % PIPELINE_QUEUE_LEN];
+    __atomic_store_n(&q->tail, tail + 1, __ATOMIC_SEQ_CST);
+    return 1;
+}
+
+static void queue_post(XvcQueue * q, XvcClient * c, XvcMessageType type) {
+    XvcMessage m;
+
+    memset(&m, 0, sizeof m);
+    m.type = type;
+    m.c = c;
+    queue_put(q, &m);
+}
+
+/*
+ * Pipelined mode: hand the reply to the network thread and continue
+ * with the spare reply buffer.  A reply that refers to external memory
+ * or resizes the receive ring must be sent before more commands are
+ * executed.
+ */
+static void post_reply(XvcClient * c) {
+    XvcMessage m;
+
+    memset(&m, 0, sizeof m);
+    m.type = MSG_REPLY;
+    m.c = c;
+    m.reply = c->reply;
+    m.sync = c->reply.ext != NULL || c->buf_next != NULL;
+    if (m.sync) {
+        c->sync = 1;
+        c->sync_release = c->reply.ext_release;
+    }
+    memset(&c->reply, 0, sizeof c->reply);
+    c->reply.buf = c->reply_spare;
+    c->reply.max = c->reply_spare_max;
+    c->reply_spare = NULL;
+    c->reply_spare_max = 0;
+    queue_put(&net_queue, &m);
 }
 
 #ifdef LOG_PACKET
@@ -217,29 +1384,123 @@ static void dumphex(
 }
 #endif
 
-static void read_packet(XvcClient * c) {
-    unsigned char * cbuf = NULL;
-    unsigned char * cend = NULL;
-    unsigned fill = 0;
+/*
+ * Session capture.  A batch is written by the thread executing the
+ * commands once the handlers have flushed, when the reply is complete
+ * and none of it has been sent yet.
+ */
+#if XVC_CAPTURE
+static FILE * capture_file = NULL;
+
+static int capture_start(void) {
+    XvcCaptureHeader h;
+
+    capture_file = fopen(capture_path, "wb");
+    if (capture_file == NULL) return -1;
+    setvbuf(capture_file, NULL, _IOFBF, 1 << 20);
+    memset(&h, 0, sizeof h);
+    h.magic = XVC_CAPTURE_MAGIC;
+    h.version = 1;
+    h.record_size = sizeof(XvcCaptureRecord);
+    fwrite(&h, sizeof h, 1, capture_file);
+    return 0;
+}
 
-    reply_buf_size(max_packet_len);
+static void capture_stop(void) {
+    if (capture_file != NULL)
+        fclose(capture_file);
+    capture_file = NULL;
+}
+
+static void capture_batch(XvcClient * c, const unsigned char * req, size_t req_len,
+                          unsigned commands, uint64_t start) {
+    uint64_t ns = stats_now() - start;
+    XvcCaptureRecord r;
+    struct iovec iov[3];
+    int n;
+    int i;
+
+    if (capture_file == NULL) return;
+    memset(&r, 0, sizeof r);
+    r.time = start;
+    r.duration = ns < UINT32_MAX ? ns : UINT32_MAX;
+    r.request_len = req_len;
+    r.reply_len = c->reply.len + c->reply.ext_len;
+    r.client = c->id;
+    r.commands = commands;
+    fwrite(&r, sizeof r, 1, capture_file);
+    fwrite(req, 1, req_len, capture_file);
+    n = reply_iovec(&c->reply, iov);
+    for (i = 0; i < n; i++)
+        fwrite(iov[i].iov_base, 1, iov[i].iov_len, capture_file);
+    fflush(capture_file);
+}
+#else
+static int capture_start(void) {
+    errno = ENOTSUP;
+    return -1;
+}
+
+static void capture_stop(void) {
+}
+
+static void capture_batch(XvcClient * c, const unsigned char * req, size_t req_len,
+                          unsigned commands, uint64_t start) {
+}
+#endif
+
+/*
+ * Execute the complete commands buffered in c->buf and send their
+ * replies.  Returns 0 when more input is needed or the reply is still
+ * being sent, and -1 when the connection must be closed.
+ */
+static int read_packet(XvcClient * c) {
+    unsigned char * cbuf = NULL;
+    unsigned char * cend = NULL;
+    unsigned fill = 0;
+    uint64_t batch_start;
+    uint64_t stats_last;
+    unsigned batch_commands;
 
-    //struct timeval stop, start;
+    if (c->handlers->select_port)
+        c->handlers->select_port(c->client_data, c);
 
 read_more:
+    if (reply_pending(c)) return 0;
+    batch_start = stats_last = stats_now();
+    batch_commands = 0;
+    if (pipeline_enabled)
+        c->buf_len = __atomic_load_n(&c->rx_head, __ATOMIC_ACQUIRE) - c->rx_tail;
+    else if (c->shm != NULL && shm_receive(c) < 0)
+        return -1;
 #ifdef LOG_PACKET
     printf("read_packet ");
-    dumphex(c->buf, c->buf_len);
+    dumphex(c->buf + c->buf_start, c->buf_len);
     printf("\n");
 #endif
-    cbuf = c->buf;
+    cbuf = c->buf + c->buf_start;
     cend = cbuf + c->buf_len;
     fill = 0;
-    reply_len = 0;
+    reply_release(c);
+    c->unpack_len = 0;
+    c->pack_count = 0;
     for (;;) {
         unsigned char * p = cbuf;
         unsigned char * e = p + 30 < cend ? p + 30 : cend;
+        size_t reply_mark = c->reply.len + c->reply.ext_len;
         unsigned len;
+        XvcCommand cmd;
+
+        /* A reply that refers to external memory is sent before the
+         * next command is executed. */
+        if (c->reply.ext != NULL) break;
+
+        /* So is the reply to configure:packet_len, and the receive
+         * buffer is replaced before parsing more */
+        if (c->buf_next != NULL) break;
+
+        /* The reply vectors to compress are listed in a fixed array */
+        if (c->pack_count == PACK_REGIONS) break;
 
         while (p < e && *p != ':') {
             // printf("cycle: %d at %x ", *p, p);
@@ -255,34 +1516,51 @@ read_more:
         }
         p++;
         len = p - cbuf;
+        cmd = decode_command(cbuf, len);
+        XVC_PROBE2(xvcserver, command__start, c->id, cmd);
 
-        if (len == 8 && memcmp(cbuf, "getinfo:", len) == 0) {
-            snprintf((char *)reply_buf + reply_len, 100, "xvcServer_v%u.%u:%u\n",
+        if (cmd == CMD_GETINFO) {
+            snprintf((char *)c->reply.buf + c->reply.len, 100, "xvcServer_v%u.%u:%u\n",
                      XVC_VERSION / 10, XVC_VERSION % 10, c->buf_max);
-            reply_len += strlen((char *)reply_buf + reply_len);
+            c->reply.len += strlen((char *)c->reply.buf + c->reply.len);
             goto reply;
         }
 
 #if XVC_VERSION >= 11
-        if (len == 13 && memcmp(cbuf, "capabilities:", len) == 0) {
+        if (cmd == CMD_CAPABILITIES) {
             unsigned bytes;
             char capabilities[100];
             capabilities[0] = '\0';
             strcat(capabilities, "status,");
+            sprintf(capabilities + strlen(capabilities), "packet_len=%u,",
+                    c->shm != NULL ? c->buf_size : MAX_PACKET_LIMIT);
+            strcat(capabilities, "compress=rle,");
+            if (XVC_STATS)
+                strcat(capabilities, "stats,");
             if (c->handlers->idpc && c->handlers->edpc)
                 strcat(capabilities, "dpc");
             bytes = strlen(capabilities);
-            reply_uleb128(bytes);
-            memcpy(reply_buf + reply_len, capabilities, bytes);
-            reply_len += bytes;
+            reply_uleb128(c, bytes);
+            memcpy(c->reply.buf + c->reply.len, capabilities, bytes);
+            c->reply.len += bytes;
+            goto reply;
+        }
+
+        if (cmd == CMD_STATS) {
+            char text[STATS_TEXT_MAX];
+            unsigned bytes = stats_format(text, sizeof text);
+            if (!reply_room(c, bytes + 5)) break;
+            reply_uleb128(c, bytes);
+            memcpy(c->reply.buf + c->reply.len, text, bytes);
+            c->reply.len += bytes;
             goto reply;
         }
 
-        if (len == 10 && memcmp(cbuf, "configure:", len) == 0) {
+        if (cmd == CMD_CONFIGURE) {
             unsigned bytes = get_uleb128(&p, cend);
             unsigned char * pktend = p + bytes;
-            char * s = (char *)p;
-            int oldc;
+            char * copy;
+            char * s;
 
             if (cend < pktend) {
                 assert(pktend - cbuf < c->buf_max);
@@ -290,8 +1568,17 @@ read_more:
                 break;
             }
 
-            oldc = *pktend;
-            *pktend = '\0';
+            /* The strings are split in a copy, so that the request
+             * stays as received for the session capture */
+            copy = (char *)malloc(bytes + 1);
+            if (copy == NULL) {
+                xvcserver_set_error(c, "cannot allocate %u byte configuration", bytes);
+                p = pktend;
+                goto reply_with_status;
+            }
+            memcpy(copy, p, bytes);
+            copy[bytes] = '\0';
+            s = copy;
             while (*s != '\0' && !c->pending_error[0]) {
                 char * config = get_field(&s, ',');
                 char * assign = strchr(config, '=');
@@ -321,28 +1608,65 @@ read_more:
                         break;
                     }
                     c->enable_status = enable;
+                } else if (strcmp(config, "compress") == 0) {
+                    if (assign && strcmp(assign, "rle") == 0) {
+                        c->compress = COMPRESS_RLE;
+                    } else if (assign && strcmp(assign, "none") == 0) {
+                        c->compress = COMPRESS_NONE;
+                    } else {
+                        xvcserver_set_error(c, "configuration \"compress\" requires rle or none");
+                        break;
+                    }
+                } else if (strcmp(config, "packet_len") == 0) {
+                    char * end = NULL;
+                    unsigned long value = assign ? strtoul(assign, &end, 0) : 0;
+                    if (!assign || *assign == '\0' || *end != '\0' ||
+                            value < max_packet_len || value > MAX_PACKET_LIMIT) {
+                        xvcserver_set_error(c, "configuration \"packet_len\" requires a value from %u to %u",
+                                            max_packet_len, MAX_PACKET_LIMIT);
+                        break;
+                    }
+                    if (c->shm != NULL) {
+                        /* The request ring of the shm: transport is
+                         * sized by the server */
+                        if (value > c->buf_size) {
+                            xvcserver_set_error(c, "configuration \"packet_len\" is limited to %u by the shm transport",
+                                                c->buf_size);
+                            break;
+                        }
+                        c->buf_max = value;
+                    } else if (value != c->buf_max) {
+                        ring_free(c->buf_next, c->buf_next_size);
+                        c->buf_next_size = value;
+                        c->buf_next = ring_alloc(&c->buf_next_size);
+                        if (c->buf_next == NULL) {
+                            xvcserver_set_error(c, "cannot allocate %lu byte packet buffer", value);
+                            break;
+                        }
+                        c->buf_next_max = value;
+                    }
                 } else {
                     xvcserver_set_error(c, "unexpected configuration: %s", config);
                     break;
                 }
             }
-            *pktend = oldc;
+            free(copy);
             p = pktend;
             goto reply_with_status;
         }
 
-        if (len == 6 && memcmp(cbuf, "error:", len) == 0) {
+        if (cmd == CMD_ERROR) {
             unsigned bytes = strlen(c->pending_error);
             if (bytes > c->buf_max - (bytes + 127)/128)
                 bytes = c->buf_max - (bytes + 127)/128;
-            reply_uleb128(bytes);
-            memcpy(reply_buf + reply_len, c->pending_error, bytes);
-            reply_len += bytes;
+            reply_uleb128(c, bytes);
+            memcpy(c->reply.buf + c->reply.len, c->pending_error, bytes);
+            c->reply.len += bytes;
             c->pending_error[0] = '\0';
             goto reply;
         }
 
-        if (len == 5 && memcmp(cbuf, "edpc:", len) == 0 && c->handlers->edpc) {
+        if (cmd == CMD_EDPC && c->handlers->edpc) {
             unsigned int flags = get_uleb128(&p, cend);
             unsigned char *epkt_buf = NULL;
             size_t num_words = 0;
@@ -352,33 +1676,60 @@ read_more:
                 fill = 1;
                 break;
             }
+            if (!reply_room(c, MAX_EDPC_REPLY_LEN)) break;
 
-            if (!c->pending_error[0])
+            if (!c->pending_error[0]) {
+                XVC_PROBE1(xvcserver, edpc__start, flags);
                 c->handlers->edpc(c->client_data, flags, &num_words, &epkt_buf);
+                XVC_PROBE1(xvcserver, edpc__done, num_words);
+            }
             num_bytes = num_words * 4;
-            reply_uleb128(num_words);
+            reply_uleb128(c, num_words);
+            if (epkt_buf && c->handlers->edpc_release && !c->pending_error[0] && !c->compress) {
+                reply_extern(c, epkt_buf, num_bytes, c->handlers->edpc_release);
+                goto reply_with_status;
+            }
             if(epkt_buf)
-                memcpy(reply_buf + reply_len, epkt_buf, num_bytes);
+                memcpy(c->reply.buf + c->reply.len, epkt_buf, num_bytes);
             if (c->pending_error[0])
-                memset(reply_buf + reply_len, 0, num_bytes);
-            reply_len += num_bytes;
+                memset(c->reply.buf + c->reply.len, 0, num_bytes);
+            pack_region(c, c->reply.len, num_bytes);
+            c->reply.len += num_bytes;
+            if (epkt_buf && c->handlers->edpc_release)
+                c->handlers->edpc_release(c->client_data);
             goto reply_with_status;
         }
 
-        if (len == 5 && memcmp(cbuf, "idpc:", len) == 0 && c->handlers->idpc) {
+        if (cmd == CMD_IDPC && c->handlers->idpc) {
             unsigned int flags = get_uleb128(&p, cend);
             size_t   num_words = get_uleb128(&p, cend);
             size_t   num_bytes = num_words * 4;
-            if (cend < p + num_bytes) {
-                assert(p + num_bytes - cbuf <= c->buf_max);
-                fill = 1;
-                break;
+            unsigned char * data = p;
+            if (c->compress && p <= cend) {
+                int r = unpack_room(c, num_bytes);
+                if (r < 0) goto error;
+                if (r == 0) break;
+                data = c->unpack_buf + c->unpack_len;
+                r = unpack_vector(c, &p, cbuf, cend, num_bytes);
+                if (r < 0) goto error;
+                if (r == 0) {
+                    fill = 1;
+                    break;
+                }
+            } else {
+                if (cend < p + num_bytes) {
+                    assert(p + num_bytes - cbuf <= c->buf_max);
+                    fill = 1;
+                    break;
+                }
+                p += num_bytes;
             }
 
-            if (!c->pending_error[0])
-                c->handlers->idpc(c->client_data, flags, num_words, p);
-
-            p += num_bytes;
+            if (!c->pending_error[0]) {
+                XVC_PROBE1(xvcserver, idpc__start, num_words);
+                c->handlers->idpc(c->client_data, flags, num_words, data);
+                XVC_PROBE1(xvcserver, idpc__done, num_words);
+            }
             goto reply_with_status;
         }
 #endif // XVC_VERSION
@@ -393,39 +1744,1053 @@ read_more:
         reply_status(c);
 #endif
     reply:
+        stats_command(c, cmd, p - cbuf, c->reply.len + c->reply.ext_len - reply_mark, &stats_last);
+        XVC_PROBE5(xvcserver, command__done, c->id, cmd, p - cbuf,
+                   c->reply.len + c->reply.ext_len - reply_mark, c->pending_error[0] != '\0');
+        batch_commands++;
         cbuf = p;
     }
 
-    if (c->buf < cbuf) {
+    if (c->buf + c->buf_start < cbuf) {
         if (c->handlers->flush)
             if (c->handlers->flush(c->client_data) < 0) goto error;
+        pack_reply(c);
 #ifdef LOG_PACKET
-        printf("send_packet - %d bytes\n", reply_len);
-        dumphex(reply_buf, reply_len);
+        printf("send_packet - %d bytes\n", c->reply.len);
+        dumphex(c->reply.buf, c->reply.len);
         printf("\n");
 #endif
-        if (send_packet(c, reply_buf, reply_len) < 0) goto error;
-        consume_packet(c, cbuf - c->buf);
+        capture_batch(c, c->buf + c->buf_start, cbuf - (c->buf + c->buf_start),
+                      batch_commands, batch_start);
+        consume_packet(c, cbuf - (c->buf + c->buf_start));
+        if (pipeline_enabled) {
+            /* The network thread owns the ring until a sync reply is sent */
+            post_reply(c);
+            stats_batch(c, batch_start);
+            if (!fill) goto read_more;
+            return 0;
+        }
+        if (send_packet(c) < 0) goto error;
+        stats_batch(c, batch_start);
+        if (c->buf_next != NULL)
+            resize_packet(c);
+        if (c->buf_len && !fill) goto read_more;
+    }
+    return 0;
+
+error:
+    fprintf(stderr, "XVC connection terminated: Error - %s\n", strerror(errno));
+    trace_dump();
+    return -1;
+}
 
-        // gettimeofday(&stop, NULL);
-        // if (start.tv_usec != 0)
-        //     printf("Shift send packet %lu u-seconds\n", stop.tv_usec - start.tv_usec);
+/*
+ * Receive what is available on the socket and execute it.  Only one
+ * recv() is done per wakeup so that a busy client cannot starve the
+ * other connections sharing the server.
+ */
+static int receive_packet(XvcClient * c) {
+    unsigned tail = (c->buf_start + c->buf_len) % c->buf_size;
+    int len;
+
+    if (reply_pending(c)) return 0;
+    if (c->buf_len >= c->buf_size) {
+        fprintf(stderr, "protocol error: receive buffer full\n");
+        return -1;
+    }
+    len = recv(c->fd, c->buf + tail, c->buf_size - c->buf_len, 0);
+    if (len == 0) return -1;
+    if (len < 0) {
+        if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+        fprintf(stderr, "XVC connection terminated: Error - %s\n", strerror(errno));
+        trace_dump();
+        return -1;
+    }
+    XVC_PROBE2(xvcserver, recv, c->id, len);
+    c->buf_len += len;
+    return read_packet(c);
+}
 
-        if (c->buf_len && !fill) goto read_more;
+static int service_client(XvcClient * c, uint32_t events) {
+    if (events & EPOLLERR) {
+        if (!c->zerocopy || zerocopy_complete(c) < 0) {
+            trace_dump();
+            return -1;
+        }
+    }
+    if (events & (EPOLLOUT | EPOLLERR)) {
+        if (send_packet(c) < 0) return -1;
+        if (reply_pending(c)) return 0;
+        if (read_packet(c) < 0) return -1;
+    }
+    if (events & (EPOLLIN | EPOLLHUP)) {
+        if (reply_pending(c)) return (events & EPOLLHUP) ? -1 : 0;
+        if (receive_packet(c) < 0) return -1;
+    }
+    return 0;
+}
+
+/*
+ * Pipelined mode.  The network thread receives into the ring and
+ * sends replies, the hardware thread parses and executes the commands
+ * and makes all handler callbacks.  hw_queue carries MSG_OPEN,
+ * MSG_DATA, MSG_SENT and MSG_CLOSE to the hardware thread and
+ * net_queue carries MSG_REPLY, MSG_ERROR and MSG_CLOSED back.  Each
+ * client owns PIPELINE_REPLIES reply buffers, so the next batch is
+ * executed while the previous reply is still being sent.
+ */
+static void pipeline_close_port(XvcClient * c) {
+    if (!c->opened) return;
+    if (c->handlers->select_port)
+        c->handlers->select_port(c->client_data, c);
+    if (c->sync && c->sync_release)
+        c->sync_release(c->client_data);
+    c->sync = 0;
+    c->handlers->close_port(c->client_data);
+    c->opened = 0;
+}
+
+static void pipeline_execute(XvcClient * c) {
+    if (!c->dead && read_packet(c) < 0) {
+        c->dead = 1;
+        queue_post(&net_queue, c, MSG_ERROR);
     }
+}
 
-    {
-        int len = recv(c->fd, c->buf + c->buf_len, c->buf_max - c->buf_len, 0);
-        if (len > 0) {
-            c->buf_len += len;
-            goto read_more;
+static void * pipeline_thread(void * arg) {
+    for (;;) {
+        XvcMessage m;
+        XvcClient * c;
+        uint64_t count;
+
+        if (!queue_get(&hw_queue, &m)) {
+            if (read(hw_queue.wake_fd, &count, sizeof count) < 0 && errno != EINTR) {
+                perror("ERROR: eventfd read failed");
+                return NULL;
+            }
+            continue;
+        }
+        c = m.c;
+        switch (m.type) {
+        case MSG_OPEN:
+            if (c->handlers->open_port(c->client_data, c) < 0) {
+                fprintf(stderr, "Opening JTAG port failed\n");
+                c->dead = 1;
+                queue_post(&net_queue, c, MSG_ERROR);
+                break;
+            }
+            c->opened = 1;
+            break;
+        case MSG_DATA:
+            __atomic_store_n(&c->kick, 0, __ATOMIC_SEQ_CST);
+            pipeline_execute(c);
+            break;
+        case MSG_SENT:
+            if (m.sync) {
+                if (m.reply.ext_release) {
+                    if (c->handlers->select_port)
+                        c->handlers->select_port(c->client_data, c);
+                    m.reply.ext_release(c->client_data);
+                }
+                c->sync = 0;
+                c->sync_release = NULL;
+            }
+            if (c->reply.buf == NULL) {
+                c->reply.buf = m.reply.buf;
+                c->reply.max = m.reply.max;
+            } else {
+                c->reply_spare = m.reply.buf;
+                c->reply_spare_max = m.reply.max;
+            }
+            pipeline_execute(c);
+            break;
+        case MSG_CLOSE:
+            pipeline_close_port(c);
+            queue_post(&net_queue, c, MSG_CLOSED);
+            break;
+        default:
+            return NULL;
         }
-        if (len < 0) goto error;
     }
-    return;
+}
+
+static int pipeline_watch(XvcClient * c) {
+    unsigned used = c->rx_head - __atomic_load_n(&c->rx_tail, __ATOMIC_ACQUIRE);
+    uint32_t events = 0;
+
+    if (used < c->buf_size)
+        events |= EPOLLIN;
+    if (c->tx_count > 0 && c->tx[0].reply.sent < c->tx[0].reply.len + c->tx[0].reply.ext_len)
+        events |= EPOLLOUT;
+    return watch_client(c, events);
+}
+
+/*
+ * Send the replies from the hardware thread in order and hand each
+ * buffer back once it is sent.  The ring is resized here, while the
+ * hardware thread waits for the reply to configure:packet_len.
+ */
+static int pipeline_send(XvcClient * c) {
+    while (c->tx_count > 0) {
+        XvcMessage * m = &c->tx[0];
+
+        if (send_reply(c, &m->reply) < 0) return -1;
+        if (m->reply.sent < m->reply.len + m->reply.ext_len ||
+                c->zerocopy_done != c->zerocopy_sent)
+            break;
+        if (m->sync && c->buf_next != NULL) {
+            c->buf_len = c->rx_head - __atomic_load_n(&c->rx_tail, __ATOMIC_ACQUIRE);
+            resize_packet(c);
+            c->rx_pos = c->buf_len;
+        }
+        m->type = MSG_SENT;
+        queue_put(&hw_queue, m);
+        memmove(c->tx, c->tx + 1, --c->tx_count * sizeof c->tx[0]);
+    }
+    return pipeline_watch(c);
+}
+
+static int pipeline_receive(XvcClient * c) {
+    unsigned used = c->rx_head - __atomic_load_n(&c->rx_tail, __ATOMIC_ACQUIRE);
+    int len;
+
+    if (used >= c->buf_size) return 0;
+    len = recv(c->fd, c->buf + c->rx_pos, c->buf_size - used, 0);
+    if (len == 0) return -1;
+    if (len < 0) {
+        if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+        fprintf(stderr, "XVC connection terminated: Error - %s\n", strerror(errno));
+        trace_dump();
+        return -1;
+    }
+    XVC_PROBE2(xvcserver, recv, c->id, len);
+    c->rx_pos = (c->rx_pos + len) % c->buf_size;
+    __atomic_store_n(&c->rx_head, c->rx_head + len, __ATOMIC_SEQ_CST);
+    if (__atomic_exchange_n(&c->kick, 1, __ATOMIC_SEQ_CST) == 0)
+        queue_post(&hw_queue, c, MSG_DATA);
+    return 0;
+}
+
+static int pipeline_service(XvcClient * c, uint32_t events) {
+    if (events & EPOLLERR) {
+        if (!c->zerocopy || zerocopy_complete(c) < 0) {
+            trace_dump();
+            return -1;
+        }
+    }
+    if (events & (EPOLLOUT | EPOLLERR)) {
+        if (pipeline_send(c) < 0) return -1;
+    }
+    if (events & EPOLLHUP) return -1;
+    if (events & EPOLLIN) {
+        if (pipeline_receive(c) < 0) return -1;
+    }
+    return pipeline_watch(c);
+}
+
+/*
+ * Stop serving the client.  It is freed when the hardware thread has
+ * closed the port and reports MSG_CLOSED.
+ */
+static void pipeline_close(XvcClient * c) {
+    if (c->closing) return;
+    c->closing = 1;
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    queue_post(&hw_queue, c, MSG_CLOSE);
+}
+
+static void free_client(XvcClient * c);
+
+static void pipeline_dispatch(void) {
+    XvcMessage m;
+    uint64_t count;
+
+    if (read(net_queue.wake_fd, &count, sizeof count) < 0 && errno != EAGAIN)
+        perror("ERROR: eventfd read failed");
+    while (queue_get(&net_queue, &m)) {
+        XvcClient * c = m.c;
+        switch (m.type) {
+        case MSG_REPLY:
+            if (c->closing) {
+                free(m.reply.buf);
+                break;
+            }
+            assert(c->tx_count < PIPELINE_REPLIES);
+            c->tx[c->tx_count++] = m;
+            if (pipeline_send(c) < 0)
+                pipeline_close(c);
+            break;
+        case MSG_ERROR:
+            pipeline_close(c);
+            break;
+        case MSG_CLOSED:
+            free_client(c);
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+static int pipeline_start(void) {
+    struct epoll_event ev;
+
+    hw_queue.wake_fd = eventfd(0, EFD_CLOEXEC);
+    net_queue.wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (hw_queue.wake_fd < 0 || net_queue.wake_fd < 0) return -1;
+    memset(&ev, 0, sizeof ev);
+    ev.events = EPOLLIN;
+    ev.data.ptr = &net_queue;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, net_queue.wake_fd, &ev) < 0) return -1;
+    errno = pthread_create(&hw_thread, NULL, pipeline_thread, NULL);
+    return errno ? -1 : 0;
+}
+
+static void pipeline_stop(void) {
+    XvcMessage m;
+
+    queue_post(&hw_queue, NULL, MSG_EXIT);
+    pthread_join(hw_thread, NULL);
+    while (queue_get(&net_queue, &m)) {
+        if (m.type == MSG_REPLY)
+            free(m.reply.buf);
+    }
+    while (clients != NULL) {
+        pipeline_close_port(clients);
+        free_client(clients);
+    }
+    close(hw_queue.wake_fd);
+    close(net_queue.wake_fd);
+}
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void free_client(XvcClient * c) {
+    XvcClient ** pc = &clients;
+    unsigned i;
+
+    while (*pc != c) pc = &(*pc)->next;
+    *pc = c->next;
+
+    if (c->fd >= 0)
+        closesocket(c->fd);
+    ring_free(c->buf, c->buf_size);
+    ring_free(c->buf_next, c->buf_next_size);
+    for (i = 0; i < c->tx_count; i++)
+        free(c->tx[i].reply.buf);
+    free(c->reply_spare);
+    free(c->reply.buf);
+    free(c->unpack_buf);
+    free(c);
+}
+
+static void close_client(XvcClient * c) {
+    if (epoll_fd >= 0)
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    if (c->handlers->select_port)
+        c->handlers->select_port(c->client_data, c);
+    reply_release(c);
+    c->handlers->close_port(c->client_data);
+    free_client(c);
+}
+
+static XvcClient * add_client(
+    int fd,
+    void * client_data,
+    XvcServerHandlers * handlers,
+    LoggingMode log_mode)
+{
+    struct sockaddr_storage client_addr;
+    socklen_t addr_len = 0;
+    struct epoll_event ev;
+    XvcClient * c;
+    int opt = 1;
+    char peer[64];
+
+    if (pipeline_enabled) {
+        unsigned count = 0;
+        for (c = clients; c != NULL; c = c->next)
+            count++;
+        if (count >= PIPELINE_MAX_CLIENTS) {
+            fprintf(stderr, "ERROR: Too many connections\n");
+            closesocket(fd);
+            return NULL;
+        }
+    }
+
+    // Get client address
+    addr_len = sizeof(client_addr);
+    if (getpeername(fd, (struct sockaddr *)&client_addr, &addr_len) < 0) {
+        fprintf(stderr, "ERROR: getpeername failed. Returned error - %s\n", strerror(errno));
+        closesocket(fd);
+        return NULL;
+    }
+    if (client_addr.ss_family == AF_INET) {
+        struct sockaddr_in * addr_in = (struct sockaddr_in *)&client_addr;
+        if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char *)&opt, sizeof(opt)) < 0)
+            fprintf(stderr, "setsockopt TCP_NODELAY failed\n");
+        snprintf(peer, sizeof peer, "%s:%d", inet_ntoa(addr_in->sin_addr), ntohs(addr_in->sin_port));
+    } else if (client_addr.ss_family == AF_VSOCK) {
+        struct sockaddr_vm * addr_vm = (struct sockaddr_vm *)&client_addr;
+        snprintf(peer, sizeof peer, "vsock:%u:%u", addr_vm->svm_cid, addr_vm->svm_port);
+    } else {
+        snprintf(peer, sizeof peer, "local socket");
+    }
+
+    if (!uring_enabled && set_nonblocking(fd) < 0) {
+        fprintf(stderr, "ERROR: fcntl O_NONBLOCK failed. Returned error - %s\n", strerror(errno));
+        closesocket(fd);
+        return NULL;
+    }
+
+    if (log_mode != LOG_MODE_QUIET)
+        fprintf(stdout, "INFO: xvcserver accepted connection from client %s \n", peer);
+
+    c = (XvcClient *)calloc(1, sizeof *c);
+    c->fd = fd;
+    c->id = ++connection_count;
+    c->handlers = handlers;
+    c->client_data = client_data;
+    c->buf_max = max_packet_len;
+    c->buf_size = c->buf_max;
+    c->buf = ring_alloc(&c->buf_size);
+    if (c->buf == NULL) {
+        fprintf(stderr, "ERROR: Failed to allocate receive buffer - %s\n", strerror(errno));
+        closesocket(fd);
+        free(c);
+        return NULL;
+    }
+    reply_buf_size(c, max_packet_len);
+    if (pipeline_enabled) {
+        c->reply_spare_max = c->reply.max;
+        c->reply_spare = (unsigned char *)malloc(c->reply_spare_max);
+    }
+#if ZEROCOPY_THRESHOLD > 0
+    /* zerocopy_complete() reads the IP error queue only */
+    c->zerocopy = client_addr.ss_family == AF_INET &&
+        setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, (char *)&opt, sizeof(opt)) == 0;
+#endif
+
+    if (!pipeline_enabled && handlers->open_port(client_data, c) < 0) {
+        fprintf(stderr, "Opening JTAG port failed\n");
+        closesocket(fd);
+        ring_free(c->buf, c->buf_size);
+        free(c->reply.buf);
+        free(c);
+        return NULL;
+    }
+
+    c->next = clients;
+    clients = c;
+    if (uring_enabled)
+        return c;
+
+    memset(&ev, 0, sizeof ev);
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    c->events = ev.events;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        fprintf(stderr, "ERROR: epoll_ctl failed. Returned error - %s\n", strerror(errno));
+        if (pipeline_enabled)
+            free_client(c);
+        else
+            close_client(c);
+        return NULL;
+    }
+    if (pipeline_enabled)
+        queue_post(&hw_queue, c, MSG_OPEN);
+    return c;
+}
+
+static void accept_client(
+    int sock,
+    void * client_data,
+    XvcServerHandlers * handlers,
+    LoggingMode log_mode)
+{
+    int fd = accept(sock, NULL, NULL);
+
+    if (fd < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            fprintf(stderr, "ERROR: accept failed. Returned error - %s\n", strerror(errno));
+        return;
+    }
+    add_client(fd, client_data, handlers, log_mode);
+}
+
+static int uring_setup(void) {
+    struct io_uring_params p;
+    unsigned char * sq;
+    unsigned char * cq;
+
+    memset(&p, 0, sizeof p);
+    uring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (uring.fd < 0) return -1;
+    uring.sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    uring.cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (uring.sq_ring_len < uring.cq_ring_len)
+            uring.sq_ring_len = uring.cq_ring_len;
+        uring.cq_ring_len = 0;
+    }
+    uring.sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    uring.sq_ring = mmap(NULL, uring.sq_ring_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQ_RING);
+    uring.cq_ring = uring.cq_ring_len == 0 ? uring.sq_ring :
+        mmap(NULL, uring.cq_ring_len, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_CQ_RING);
+    uring.sqes = (struct io_uring_sqe *)mmap(NULL, uring.sqes_len, PROT_READ | PROT_WRITE,
+                                             MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQES);
+    if (uring.sq_ring == MAP_FAILED || uring.cq_ring == MAP_FAILED || uring.sqes == MAP_FAILED) {
+        close(uring.fd);
+        return -1;
+    }
+    sq = (unsigned char *)uring.sq_ring;
+    cq = (unsigned char *)uring.cq_ring;
+    uring.sq_head = (unsigned *)(sq + p.sq_off.head);
+    uring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    uring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    uring.sq_array = (unsigned *)(sq + p.sq_off.array);
+    uring.cq_head = (unsigned *)(cq + p.cq_off.head);
+    uring.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    uring.cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    uring.to_submit = 0;
+    uring.multishot_accept = 1;
+    return 0;
+}
+
+static void uring_exit(void) {
+    munmap(uring.sqes, uring.sqes_len);
+    if (uring.cq_ring_len != 0)
+        munmap(uring.cq_ring, uring.cq_ring_len);
+    munmap(uring.sq_ring, uring.sq_ring_len);
+    close(uring.fd);
+}
+
+/*
+ * Submit the queued entries and wait for <wait> completions.
+ */
+static int uring_enter(unsigned wait) {
+    int n = syscall(__NR_io_uring_enter, uring.fd, uring.to_submit, wait,
+                    wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (n < 0) return -1;
+    uring.to_submit -= n;
+    return 0;
+}
+
+/*
+ * Get a cleared submission queue entry.  Entries are handed to the
+ * kernel in batches by the next uring_enter().
+ */
+static struct io_uring_sqe * uring_get_sqe(void) {
+    unsigned tail = *uring.sq_tail;
+    unsigned mask = *uring.sq_mask;
+    struct io_uring_sqe * sqe;
+
+    if (tail - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE) > mask &&
+            uring_enter(0) < 0)
+        return NULL;
+    sqe = &uring.sqes[tail & mask];
+    memset(sqe, 0, sizeof *sqe);
+    uring.sq_array[tail & mask] = tail & mask;
+    return sqe;
+}
+
+static void uring_queue_sqe(void) {
+    __atomic_store_n(uring.sq_tail, *uring.sq_tail + 1, __ATOMIC_RELEASE);
+    uring.to_submit++;
+}
+
+static int uring_accept(int sock) {
+    struct io_uring_sqe * sqe = uring_get_sqe();
+
+    if (sqe == NULL) return -1;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = sock;
+    if (uring.multishot_accept)
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = URING_ACCEPT;
+    uring_queue_sqe();
+    return 0;
+}
+
+/*
+ * Keep one recv queued per client, straight into the free part of its
+ * receive ring.  Like the epoll loop, nothing is received while a reply
+ * is being sent.
+ */
+static int uring_recv(XvcClient * c) {
+    unsigned tail = (c->buf_start + c->buf_len) % c->buf_size;
+    struct io_uring_sqe * sqe;
+
+    if (c->recv_armed || c->closing || reply_pending(c)) return 0;
+    if (c->buf_len >= c->buf_size) {
+        fprintf(stderr, "protocol error: receive buffer full\n");
+        return -1;
+    }
+    sqe = uring_get_sqe();
+    if (sqe == NULL) return -1;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->addr = (uintptr_t)(c->buf + tail);
+    sqe->len = c->buf_size - c->buf_len;
+    sqe->user_data = (uintptr_t)c | URING_RECV;
+    uring_queue_sqe();
+    c->recv_armed = 1;
+    c->uring_ops++;
+    return 0;
+}
+
+static int uring_send(XvcClient * c) {
+    struct io_uring_sqe * sqe;
+
+    if (c->reply.sent >= c->reply.len + c->reply.ext_len) return 0;
+    sqe = uring_get_sqe();
+    if (sqe == NULL) return -1;
+    memset(&c->uring_msg, 0, sizeof c->uring_msg);
+    c->uring_msg.msg_iov = c->uring_iov;
+    c->uring_msg.msg_iovlen = reply_iovec(&c->reply, c->uring_iov);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = c->fd;
+    sqe->addr = (uintptr_t)&c->uring_msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uintptr_t)c | URING_SEND;
+    uring_queue_sqe();
+    c->uring_ops++;
+    return 0;
+}
+
+/*
+ * Shut the connection down and free the client once the kernel has
+ * completed every operation that refers to its buffers.
+ */
+static void uring_close(XvcClient * c) {
+    if (!c->closing) {
+        c->closing = 1;
+        shutdown(c->fd, SHUT_RDWR);
+    }
+    if (c->uring_ops == 0)
+        close_client(c);
+}
+
+static void uring_complete(
+    struct io_uring_cqe * cqe,
+    int sock,
+    void * client_data,
+    XvcServerHandlers * handlers,
+    LoggingMode log_mode)
+{
+    XvcClient * c = (XvcClient *)(uintptr_t)(cqe->user_data & ~(uint64_t)URING_OP_MASK);
+
+    switch (cqe->user_data & URING_OP_MASK) {
+    case URING_ACCEPT:
+        if (cqe->res >= 0) {
+            c = add_client(cqe->res, client_data, handlers, log_mode);
+            if (c != NULL && uring_recv(c) < 0)
+                uring_close(c);
+        } else if (cqe->res == -EINVAL && uring.multishot_accept) {
+            uring.multishot_accept = 0;
+        } else if (cqe->res != -EAGAIN && cqe->res != -EINTR) {
+            fprintf(stderr, "ERROR: accept failed. Returned error - %s\n", strerror(-cqe->res));
+        }
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+            uring_accept(sock);
+        return;
+
+    case URING_RECV:
+        c->uring_ops--;
+        c->recv_armed = 0;
+        if (c->closing) break;
+        if (cqe->res == -EAGAIN || cqe->res == -EINTR) {
+            if (uring_recv(c) < 0) break;
+            return;
+        }
+        if (cqe->res <= 0) {
+            if (cqe->res < 0) {
+                fprintf(stderr, "XVC connection terminated: Error - %s\n", strerror(-cqe->res));
+                trace_dump();
+            }
+            break;
+        }
+        XVC_PROBE2(xvcserver, recv, c->id, cqe->res);
+        c->buf_len += cqe->res;
+        if (read_packet(c) < 0 || uring_recv(c) < 0) break;
+        return;
+
+    case URING_SEND:
+        c->uring_ops--;
+        if (c->closing) break;
+        if (cqe->res < 0 && cqe->res != -EAGAIN && cqe->res != -EINTR) {
+            fprintf(stderr, "XVC connection terminated: Error - %s\n", strerror(-cqe->res));
+            trace_dump();
+            break;
+        }
+        if (cqe->res > 0) {
+            XVC_PROBE2(xvcserver, send, c->id, cqe->res);
+            c->reply.sent += cqe->res;
+        }
+        if (reply_pending(c)) {
+            if (uring_send(c) < 0) break;
+            return;
+        }
+        if (read_packet(c) < 0 || uring_recv(c) < 0) break;
+        return;
+    }
+    uring_close(c);
+}
+
+/*
+ * Event loop on io_uring.  Sends and receives of all clients are queued
+ * as they come up and submitted together with a single system call,
+ * which also waits for the next completions.
+ */
+static void uring_run(
+    int sock,
+    void * client_data,
+    XvcServerHandlers * handlers,
+    LoggingMode log_mode)
+{
+    if (uring_accept(sock) < 0) return;
+    for (;;) {
+        unsigned head;
+
+        if (uring_enter(1) < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+            perror("ERROR: io_uring_enter failed");
+            break;
+        }
+        head = *uring.cq_head;
+        while (head != __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe cqe = uring.cqes[head & *uring.cq_mask];
+            __atomic_store_n(uring.cq_head, ++head, __ATOMIC_RELEASE);
+            uring_complete(&cqe, sock, client_data, handlers, log_mode);
+        }
+    }
+    while (clients != NULL)
+        close_client(clients);
+}
+
+/*
+ * shm: transport.  The client writes commands into the request ring of
+ * a shared memory segment and reads replies from the reply ring.  Both
+ * rings are mapped twice back to back like the socket receive ring, so
+ * read_packet() parses the request ring in place.  The two sides sleep
+ * on futexes in the segment header and wake each other only when the
+ * other side is waiting.
+ */
+static int shm_setup(const char * name) {
+    long page = sysconf(_SC_PAGESIZE);
+    unsigned size = (max_packet_len + page - 1) / page * page;
+    XvcShmHeader * h;
+
+    if (strchr(name, '/') != NULL || strlen(name) + 2 > sizeof shm.name) {
+        errno = EINVAL;
+        return -1;
+    }
+    snprintf(shm.name, sizeof shm.name, "/%s", name);
+    shm.fd = shm_open(shm.name, O_RDWR | O_CREAT, 0660);
+    if (shm.fd < 0) return -1;
+    shm.hdr_len = (sizeof *h + page - 1) / page * page;
+    if (ftruncate(shm.fd, shm.hdr_len + 2 * (off_t)size) < 0) goto error;
+    shm.hdr = (XvcShmHeader *)mmap(NULL, shm.hdr_len, PROT_READ | PROT_WRITE, MAP_SHARED, shm.fd, 0);
+    if (shm.hdr == (XvcShmHeader *)MAP_FAILED) {
+        shm.hdr = NULL;
+        goto error;
+    }
+    shm.req = ring_map(shm.fd, shm.hdr_len, size);
+    if (shm.req == NULL) goto error;
+    shm.rep = ring_map(shm.fd, shm.hdr_len + size, size);
+    if (shm.rep == NULL) goto error;
+
+    h = shm.hdr;
+    __atomic_store_n(&h->magic, 0, __ATOMIC_SEQ_CST);
+    memset(h, 0, sizeof *h);
+    h->req_offset = shm.hdr_len;
+    h->req_size = size;
+    h->rep_offset = shm.hdr_len + size;
+    h->rep_size = size;
+    __atomic_store_n(&h->magic, XVC_SHM_MAGIC, __ATOMIC_RELEASE);
+    return 0;
 
 error:
-    fprintf(stderr, "XVC connection terminated: Error - %s\n", strerror(errno));
+    {
+        int err = errno;
+        ring_free(shm.req, size);
+        if (shm.hdr != NULL)
+            munmap(shm.hdr, shm.hdr_len);
+        close(shm.fd);
+        shm_unlink(shm.name);
+        errno = err;
+    }
+    return -1;
+}
+
+static void shm_exit(void) {
+    ring_free(shm.req, shm.hdr->req_size);
+    ring_free(shm.rep, shm.hdr->rep_size);
+    munmap(shm.hdr, shm.hdr_len);
+    close(shm.fd);
+    shm_unlink(shm.name);
+}
+
+static void shm_notify(XvcShmHeader * h) {
+    __atomic_add_fetch(&h->client_seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&h->client_wait, __ATOMIC_SEQ_CST))
+        syscall(SYS_futex, &h->client_seq, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/*
+ * Sleep until the client changes server_seq from <seq>.  While a
+ * session is open the wait times out every second, so that a client
+ * that exits without closing the session is noticed.  Returns 0 on
+ * timeout.
+ */
+static int shm_wait(XvcShmHeader * h, unsigned seq, int timed) {
+    struct timespec timeout = { 1, 0 };
+    long rval;
+
+    __atomic_store_n(&h->server_wait, 1, __ATOMIC_SEQ_CST);
+    rval = syscall(SYS_futex, &h->server_seq, FUTEX_WAIT, seq, timed ? &timeout : NULL, NULL, 0);
+    __atomic_store_n(&h->server_wait, 0, __ATOMIC_RELAXED);
+    return rval < 0 && errno == ETIMEDOUT ? 0 : 1;
+}
+
+/*
+ * Copy as much of the reply as fits into the reply ring.  The rest is
+ * copied when the client has made room.
+ */
+static int shm_send(XvcClient * c) {
+    XvcShmHeader * h = c->shm;
+    XvcReply * r = &c->reply;
+    unsigned head = h->rep_head;
+    unsigned room = h->rep_size - (head - __atomic_load_n(&h->rep_tail, __ATOMIC_ACQUIRE));
+    struct iovec iov[3];
+    int n = reply_iovec(r, iov);
+    int i;
+
+    for (i = 0; i < n && room > 0; i++) {
+        size_t len = iov[i].iov_len < room ? iov[i].iov_len : room;
+        memcpy(shm.rep + head % h->rep_size, iov[i].iov_base, len);
+        head += len;
+        room -= len;
+        r->sent += len;
+    }
+    __atomic_store_n(&h->rep_head, head, __ATOMIC_RELEASE);
+    shm_notify(h);
+    return 0;
+}
+
+static XvcClient * shm_open_session(
+    void * client_data,
+    XvcServerHandlers * handlers,
+    LoggingMode log_mode)
+{
+    XvcShmHeader * h = shm.hdr;
+    XvcClient * c;
+
+    h->req_head = h->req_tail = 0;
+    h->rep_head = h->rep_tail = 0;
+
+    c = (XvcClient *)calloc(1, sizeof *c);
+    c->fd = -1;
+    c->id = ++connection_count;
+    c->shm = h;
+    c->handlers = handlers;
+    c->client_data = client_data;
+    c->buf = shm.req;
+    c->buf_size = h->req_size;
+    c->buf_max = max_packet_len;
+    reply_buf_size(c, max_packet_len);
+
+    if (handlers->open_port(client_data, c) < 0) {
+        fprintf(stderr, "Opening JTAG port failed\n");
+        free(c->reply.buf);
+        free(c);
+        __atomic_store_n(&h->state, XVC_SHM_IDLE, __ATOMIC_RELEASE);
+        shm_notify(h);
+        return NULL;
+    }
+    c->next = clients;
+    clients = c;
+
+    if (log_mode != LOG_MODE_QUIET)
+        fprintf(stdout, "INFO: xvcserver accepted connection from process %u \n", h->client_pid);
+    __atomic_store_n(&h->state, XVC_SHM_OPEN, __ATOMIC_RELEASE);
+    shm_notify(h);
+    return c;
+}
+
+static void shm_close_session(XvcClient * c) {
+    XvcShmHeader * h = c->shm;
+
+    /* The request ring belongs to the segment */
+    c->buf = NULL;
+    close_client(c);
+    __atomic_store_n(&h->state, XVC_SHM_IDLE, __ATOMIC_RELEASE);
+    shm_notify(h);
+}
+
+static int shm_client_alive(XvcShmHeader * h) {
+    return kill((pid_t)h->client_pid, 0) == 0 || errno != ESRCH;
+}
+
+/*
+ * Event loop of the shm: transport.  One session is served at a time,
+ * a client that finds the segment busy waits for XVC_SHM_IDLE.
+ */
+static void shm_run(
+    void * client_data,
+    XvcServerHandlers * handlers,
+    LoggingMode log_mode)
+{
+    XvcShmHeader * h = shm.hdr;
+    XvcClient * c = NULL;
+    unsigned seen = 0;
+
+    for (;;) {
+        unsigned seq = __atomic_load_n(&h->server_seq, __ATOMIC_SEQ_CST);
+        unsigned state = __atomic_load_n(&h->state, __ATOMIC_ACQUIRE);
+        unsigned head;
+        int pending;
+
+        if (c == NULL) {
+            if (state == XVC_SHM_CONNECT) {
+                c = shm_open_session(client_data, handlers, log_mode);
+                seen = 0;
+                continue;
+            }
+            if (state != XVC_SHM_IDLE) {
+                __atomic_store_n(&h->state, XVC_SHM_IDLE, __ATOMIC_RELEASE);
+                shm_notify(h);
+                continue;
+            }
+            shm_wait(h, seq, 0);
+            continue;
+        }
+        if (state != XVC_SHM_OPEN) {
+            shm_close_session(c);
+            c = NULL;
+            continue;
+        }
+
+        pending = reply_pending(c);
+        if (pending)
+            shm_send(c);
+        head = __atomic_load_n(&h->req_head, __ATOMIC_ACQUIRE);
+        if (!reply_pending(c) && (pending || head != seen)) {
+            seen = head;
+            if (read_packet(c) < 0) {
+                shm_close_session(c);
+                c = NULL;
+            }
+            continue;
+        }
+        if (!shm_wait(h, seq, 1) && !shm_client_alive(h)) {
+            fprintf(stderr, "XVC connection terminated: client process %u exited\n", h->client_pid);
+            trace_dump();
+            shm_close_session(c);
+            c = NULL;
+        }
+    }
+}
+
+/*
+ * Metrics port.  A thread of its own accepts connections, writes the
+ * command statistics in the format of stats: and closes the
+ * connection, so any event loop and transport can be watched.
+ */
+static int metrics_sock = -1;
+static pthread_t metrics_thread;
+
+static void * metrics_serve(void * arg) {
+    char text[STATS_TEXT_MAX];
+
+    for (;;) {
+        unsigned len;
+        unsigned pos = 0;
+        int fd = accept(metrics_sock, NULL, NULL);
+
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break;
+        }
+        len = stats_format(text, sizeof text);
+        while (pos < len) {
+            ssize_t rval = send(fd, text + pos, len - pos, MSG_NOSIGNAL);
+            if (rval < 0 && errno == EINTR) continue;
+            if (rval <= 0) break;
+            pos += rval;
+        }
+        closesocket(fd);
+    }
+    return NULL;
+}
+
+static int metrics_start(void) {
+    char * addr = strdup(metrics_addr);
+    char * p = addr;
+    char * host = get_field(&p, ':');
+    char * port = p;
+
+    if (*port == '\0') {
+        port = host;
+        host = "";
+    }
+    metrics_sock = open_server(host, port);
+    free(addr);
+    if (metrics_sock < 0) return -1;
+    if (pthread_create(&metrics_thread, NULL, metrics_serve, NULL) != 0) {
+        closesocket(metrics_sock);
+        metrics_sock = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static void metrics_stop(void) {
+    if (metrics_sock < 0) return;
+    shutdown(metrics_sock, SHUT_RDWR);
+    pthread_join(metrics_thread, NULL);
+    closesocket(metrics_sock);
+    metrics_sock = -1;
+}
+
+int xvcserver_set_packet_len(unsigned len) {
+    if (len < MIN_PACKET_LEN || len > MAX_PACKET_LIMIT) {
+        fprintf(stderr, "ERROR: Packet length must be from %u to %u\n",
+                MIN_PACKET_LEN, MAX_PACKET_LIMIT);
+        return ERROR_INVALID_ARGUMENT;
+    }
+    max_packet_len = len;
+    return NO_ERROR;
+}
+
+void xvcserver_set_pipeline(int enable) {
+    pipeline_enabled = enable != 0;
+}
+
+void xvcserver_set_io_uring(int enable) {
+    uring_enabled = enable != 0;
+}
+
+void xvcserver_set_metrics(const char * addr) {
+    free(metrics_addr);
+    metrics_addr = addr != NULL ? strdup(addr) : NULL;
+}
+
+void xvcserver_set_capture_file(const char * path) {
+    free(capture_path);
+    capture_path = path != NULL ? strdup(path) : NULL;
+}
+
+void xvcserver_set_trace_file(const char * path) {
+    snprintf(trace_path, sizeof trace_path, "%s", path != NULL ? path : "");
 }
 
 int xvcserver_start(
@@ -434,38 +2799,53 @@ int xvcserver_start(
     XvcServerHandlers * handlers,
     LoggingMode log_mode)
 {
-    XvcClient * c = &xvc_client;
     int sock;
-    int fd;
     char * url_copy = strdup(url);
     char * p = url_copy;
     const char * transport = NULL;
     const char * host = NULL;
     const char * port = NULL;
-    struct sockaddr_in client_addr;
-    socklen_t addr_len = 0 ;
     char tmpname[1024];
+    int vsock = 0;
     int ret = 0;
 
+    init_commands();
+    trace_start(log_mode);
+
     transport = get_field(&p, ':');
-    if ((transport[0] == 'T' || transport[0] == 't') &&
-        (transport[1] == 'C' || transport[1] == 'c') &&
-        (transport[2] == 'P' || transport[2] == 'p') &&
-        transport[3] == '\0') {
-        host = get_field(&p, ':');
-    } else if (strchr(p, ':') == NULL) {
-        host = transport;
-        transport = "tcp";
+    if (strcasecmp(transport, "unix") == 0 || strcasecmp(transport, "shm") == 0) {
+        /* The rest of the url is the socket path or the segment name */
+        host = p;
+        port = NULL;
+        if (*host == '\0') {
+            fprintf(stderr, "ERROR: Missing url field: %s:<%s>\n", transport,
+                    strcasecmp(transport, "shm") == 0 ? "name" : "path");
+            ret = ERROR_INVALID_URL_FIELD;
+            goto cleanup;
+        }
     } else {
-        fprintf(stderr, "ERROR: Invalid transport type: %s\n", transport);
-        ret = ERROR_INVALID_URL_TRANSPORT_TYPE;
-        goto cleanup;
-    }
-    port = get_field(&p, ':');
-    if (*p != '\0') {
-        fprintf(stderr, "ERROR: Unexpected url field: %s\n", p);
-        ret = ERROR_INVALID_URL_FIELD;
-        goto cleanup;
+        if ((transport[0] == 'T' || transport[0] == 't') &&
+            (transport[1] == 'C' || transport[1] == 'c') &&
+            (transport[2] == 'P' || transport[2] == 'p') &&
+            transport[3] == '\0') {
+            host = get_field(&p, ':');
+        } else if (strcasecmp(transport, "vsock") == 0) {
+            host = get_field(&p, ':');
+            vsock = 1;
+        } else if (strchr(p, ':') == NULL) {
+            host = transport;
+            transport = "tcp";
+        } else {
+            fprintf(stderr, "ERROR: Invalid transport type: %s\n", transport);
+            ret = ERROR_INVALID_URL_TRANSPORT_TYPE;
+            goto cleanup;
+        }
+        port = get_field(&p, ':');
+        if (*p != '\0') {
+            fprintf(stderr, "ERROR: Unexpected url field: %s\n", p);
+            ret = ERROR_INVALID_URL_FIELD;
+            goto cleanup;
+        }
     }
 
 #ifdef _WIN32
@@ -480,13 +2860,66 @@ int xvcserver_start(
     }
 #endif
 
-    sock = open_server(host, port);
+    if (metrics_addr != NULL) {
+        if (metrics_start() < 0) {
+            perror("ERROR: Failed to open metrics port");
+            ret = ERROR_SOCKET_CREATION;
+            goto cleanup;
+        }
+        if (log_mode != LOG_MODE_QUIET)
+            fprintf(stdout, "INFO: Command statistics are served on port %s\n", metrics_addr);
+    }
+
+    if (capture_path != NULL) {
+        if (capture_start() < 0) {
+            fprintf(stderr, "ERROR: Failed to open capture file %s: %s\n", capture_path, strerror(errno));
+            ret = ERROR_INVALID_ARGUMENT;
+            goto cleanup;
+        }
+        if (log_mode != LOG_MODE_QUIET)
+            fprintf(stdout, "INFO: Capturing the session to %s\n", capture_path);
+    }
+
+    if (port == NULL && strcasecmp(transport, "shm") == 0) {
+        if (shm_setup(host) < 0) {
+            perror("ERROR: Failed to create shared memory segment");
+            ret = ERROR_SOCKET_CREATION;
+            goto cleanup;
+        }
+        if (log_mode != LOG_MODE_QUIET) {
+            if (pipeline_enabled || uring_enabled)
+                fprintf(stdout, "INFO: %s is not used with the shm transport\n",
+                        pipeline_enabled ? "Pipelined mode" : "io_uring");
+            fprintf(stdout, "INFO: To connect to this xvc_mem instance use url: shm:%s\n\n", host);
+        }
+        pipeline_enabled = 0;
+        uring_enabled = 0;
+        shm_run(client_data, handlers, log_mode);
+        shm_exit();
+        goto cleanup;
+    }
+
+    if (port == NULL)
+        sock = open_unix_server(host);
+    else if (vsock)
+        sock = open_vsock_server(host, port);
+    else
+        sock = open_server(host, port);
     if (sock < 0) {
         perror("ERROR: Failed to create socket");
         ret = ERROR_SOCKET_CREATION;
         goto cleanup;
+    } else if (port == NULL) {
+        if (log_mode != LOG_MODE_QUIET)
+            fprintf(stdout, "INFO: To connect to this xvc_mem instance use url: unix:%s\n\n", host);
     } else {
-        if (host[0] == '\0') {
+        if (host[0] == '\0' && vsock) {
+            unsigned cid = vsock_local_cid();
+            if (cid != VMADDR_CID_ANY) {
+                snprintf(tmpname, sizeof tmpname, "%u", cid);
+                host = tmpname;
+            }
+        } else if (host[0] == '\0') {
             if (gethostname(tmpname, sizeof(tmpname)) != 0) {
                 ret = ERROR_GETHOSTNAME_FAILED;
                 closesocket(sock);
@@ -498,48 +2931,75 @@ int xvcserver_start(
             fprintf(stdout, "INFO: To connect to this xvc_mem instance use url: %s:%s:%s\n\n", transport, host, port);
     }
 
-    while ((fd = accept(sock, NULL, NULL)) >= 0) {
-        int opt = 1;
-        int client_port = 0;
-        char *client_ip;
-
-        if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char *)&opt, sizeof(opt)) < 0)
-            fprintf(stderr, "setsockopt TCP_NODELAY failed\n");
-
-        // Get client address
-        addr_len = sizeof(client_addr);
-        if (getpeername(fd, (struct sockaddr *)&client_addr, &addr_len) < 0) {
-            fprintf(stderr, "ERROR: getpeername failed. Returned error - %s\n", strerror(errno));
-            continue;
+    if (uring_enabled) {
+        if (!pipeline_enabled && uring_setup() == 0) {
+            uring_run(sock, client_data, handlers, log_mode);
+            uring_exit();
+            closesocket(sock);
+            goto cleanup;
         }
-        client_ip = inet_ntoa(client_addr.sin_addr);
-        client_port = htons(client_addr.sin_port);
-
         if (log_mode != LOG_MODE_QUIET)
-            fprintf(stdout, "INFO: xvcserver accepted connection from client %s:%d \n", client_ip, client_port);
+            fprintf(stdout, "INFO: %s, using epoll\n", pipeline_enabled ?
+                    "io_uring is not used in pipelined mode" : "io_uring is not available");
+        uring_enabled = 0;
+    }
 
-        memset(c, 0, sizeof *c);
-        c->fd = fd;
-        c->handlers = handlers;
-        c->client_data = client_data;
-        c->buf_max = max_packet_len;
-        c->buf = (uint8_t *)malloc(c->buf_max);
+    epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0 || set_nonblocking(sock) < 0) {
+        perror("ERROR: Failed to create event loop");
+        ret = ERROR_SOCKET_CREATION;
+        closesocket(sock);
+        goto cleanup;
+    }
+    {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof ev);
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &ev);
+    }
+    if (pipeline_enabled && pipeline_start() < 0) {
+        perror("ERROR: Failed to start hardware thread");
+        ret = ERROR_SOCKET_CREATION;
+        closesocket(sock);
+        goto cleanup;
+    }
 
-        if (handlers->open_port(client_data, c) < 0) {
-            fprintf(stderr, "Opening JTAG port failed\n");
-            closesocket(fd);
-            free(c->buf);
-            continue;
-        }
+    for (;;) {
+        struct epoll_event events[MAX_EPOLL_EVENTS];
+        int n = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, -1);
+        int i;
 
-        read_packet(c);
-        handlers->close_port(client_data);
-        closesocket(fd);
-        free(c->buf);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("ERROR: epoll_wait failed");
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            XvcClient * c = (XvcClient *)events[i].data.ptr;
+            if (c == NULL) {
+                accept_client(sock, client_data, handlers, log_mode);
+            } else if (events[i].data.ptr == &net_queue) {
+                pipeline_dispatch();
+            } else if (pipeline_enabled) {
+                if (pipeline_service(c, events[i].events) < 0)
+                    pipeline_close(c);
+            } else if (service_client(c, events[i].events) < 0) {
+                close_client(c);
+            }
+        }
     }
+    if (pipeline_enabled)
+        pipeline_stop();
+    while (clients != NULL)
+        close_client(clients);
+    close(epoll_fd);
+    epoll_fd = -1;
     closesocket(sock);
 
 cleanup:
+    metrics_stop();
+    capture_stop();
     free(url_copy);
     return ret;
 }
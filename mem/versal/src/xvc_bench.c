@@ -0,0 +1,307 @@
+/*********************************************************************
+ * Copyright (c) 2021 Xilinx, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **********************************************************************/
+
+/*
+ * xvc_bench
+ *
+ * Host benchmark for the XVC protocol engine.  xvcserver.c is included
+ * directly so the static decoder, ULEB128 helpers and read_packet()
+ * can be driven without a board.  Memory commands run against a plain
+ * buffer, so the numbers are the cost of parsing, dispatch and reply
+ * building alone.
+ */
+
+#include "xvcserver.c"
+
+#include <time.h>
+
+#define BENCH_MEM_SIZE 0x10000
+#define BENCH_BATCH 32768
+#define BENCH_VALUES 65536
+#define BENCH_MIN_NS 500000000.0
+
+static unsigned char bench_mem[BENCH_MEM_SIZE];
+static uint32_t bench_seed = 1;
+
+static uint32_t bench_rand(void) {
+    bench_seed ^= bench_seed << 13;
+    bench_seed ^= bench_seed >> 17;
+    bench_seed ^= bench_seed << 5;
+    return bench_seed;
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int bench_open_port(void * client_data, XvcClient * c) {
+    return 0;
+}
+
+static void bench_close_port(void * client_data) {
+}
+
+static void bench_set_tck(void * client_data, unsigned long nsperiod, unsigned long * result) {
+    *result = nsperiod;
+}
+
+static void bench_shift_tms_tdi(
+    void * client_data,
+    unsigned long bitcount,
+    unsigned char * tms_buf,
+    unsigned char * tdi_buf,
+    unsigned char * tdo_buf) {
+    memcpy(tdo_buf, tdi_buf, (bitcount + 7) / 8);
+}
+
+static void bench_mrd(void * client_data, unsigned flags, size_t addr, size_t num_bytes, unsigned char * buf) {
+    memcpy(buf, bench_mem + addr % (BENCH_MEM_SIZE - num_bytes), num_bytes);
+}
+
+static void bench_mwr(void * client_data, unsigned flags, size_t addr, size_t num_bytes, unsigned char * buf) {
+    memcpy(bench_mem + addr % (BENCH_MEM_SIZE - num_bytes), buf, num_bytes);
+}
+
+static XvcServerHandlers bench_handlers = {
+    bench_open_port,
+    bench_close_port,
+    bench_set_tck,
+    bench_shift_tms_tdi,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    bench_mrd,
+    bench_mwr,
+    NULL,
+    NULL,
+    NULL,
+    NULL
+};
+
+static unsigned char * put_uleb128(unsigned char * p, uint64_t value) {
+    do {
+        *p++ = (value >= 0x80 ? 0x80 : 0) | (value & 0x7f);
+        value >>= 7;
+    } while (value);
+    return p;
+}
+
+static unsigned char * put_mrd(unsigned char * p, size_t addr, size_t num_bytes) {
+    memcpy(p, "mrd:", 4);
+    p = put_uleb128(p + 4, 0);
+    p = put_uleb128(p, addr);
+    return put_uleb128(p, num_bytes);
+}
+
+static unsigned char * put_mwr(unsigned char * p, size_t addr, size_t num_bytes) {
+    memcpy(p, "mwr:", 4);
+    p = put_uleb128(p + 4, 0);
+    p = put_uleb128(p, addr);
+    p = put_uleb128(p, num_bytes);
+    memset(p, 0x5a, num_bytes);
+    return p + num_bytes;
+}
+
+static unsigned char * put_shift(unsigned char * p, unsigned bits) {
+    unsigned bytes = (bits + 7) / 8;
+    memcpy(p, "shift:", 6);
+    set_uint_le(p + 6, 4, bits);
+    memset(p + 10, 0, bytes);
+    memset(p + 10 + bytes, 0xa5, bytes);
+    return p + 10 + 2 * bytes;
+}
+
+/* Register reads of a debug core: 4 byte mrd: */
+static unsigned char * mix_mrd4(unsigned char * p) {
+    return put_mrd(p, 0xA4000000 + (bench_rand() & 0xfffc), 4);
+}
+
+/* Register writes: 4 byte mwr: */
+static unsigned char * mix_mwr4(unsigned char * p) {
+    return put_mwr(p, 0xA4000000 + (bench_rand() & 0xfffc), 4);
+}
+
+/* ILA arm and upload: mostly register reads, some writes and block reads */
+static unsigned char * mix_ila(unsigned char * p) {
+    unsigned r = bench_rand() % 10;
+    if (r < 6) return put_mrd(p, 0xA4000000 + (bench_rand() & 0xfffc), 4);
+    if (r < 9) return put_mwr(p, 0xA4000000 + (bench_rand() & 0xfffc), 4);
+    return put_mrd(p, 0xA4000000 + (bench_rand() & 0xf000), 256);
+}
+
+/* JTAG scan chain traffic: short shift: vectors */
+static unsigned char * mix_shift(unsigned char * p) {
+    return put_shift(p, 32 + bench_rand() % 64);
+}
+
+typedef struct {
+    const char * name;
+    unsigned char * (*put)(unsigned char * p);
+} BenchMix;
+
+static const BenchMix mixes[] = {
+    { "mrd4", mix_mrd4 },
+    { "mwr4", mix_mwr4 },
+    { "ila", mix_ila },
+    { "shift", mix_shift },
+};
+
+static void report(const char * name, double count, const char * unit, double ns) {
+    printf("%-16s %12.0f %-6s %8.1f ns/%s %10.2f M%s/s\n",
+           name, count, unit, ns / count, unit, count * 1e3 / ns, unit);
+}
+
+static void bench_decode(void) {
+    static const char * names[] = { "mrd:", "mwr:", "mrd:", "shift:", "mrd:", "mwr:", "getinfo:", "state:" };
+    unsigned lens[8];
+    unsigned long count = 0;
+    unsigned sum = 0;
+    double start = now_ns();
+    double ns;
+    unsigned i;
+
+    for (i = 0; i < 8; i++)
+        lens[i] = strlen(names[i]);
+    do {
+        for (i = 0; i < 1000000; i++)
+            sum += decode_command((const unsigned char *)names[i & 7], lens[i & 7]);
+        count += i;
+        ns = now_ns() - start;
+    } while (ns < BENCH_MIN_NS);
+    report("decode", count, "cmd", ns);
+    if (sum == 0) printf("\n");
+}
+
+static void bench_uleb128(void) {
+    static uint64_t values[BENCH_VALUES];
+    XvcClient c;
+    unsigned long count = 0;
+    uint64_t sum = 0;
+    double start;
+    double ns;
+    unsigned i;
+
+    memset(&c, 0, sizeof c);
+    reply_buf_size(&c, BENCH_VALUES * 10);
+    for (i = 0; i < BENCH_VALUES; i++) {
+        switch (bench_rand() % 3) {
+        case 0: values[i] = bench_rand() & 0x7f; break;
+        case 1: values[i] = 0xA4000000 + (bench_rand() & 0xffff); break;
+        default: values[i] = bench_rand() & 0xffff; break;
+        }
+    }
+
+    start = now_ns();
+    do {
+        c.reply.len = 0;
+        for (i = 0; i < BENCH_VALUES; i++)
+            reply_uleb128(&c, values[i]);
+        count += i;
+        ns = now_ns() - start;
+    } while (ns < BENCH_MIN_NS);
+    report("uleb128 encode", count, "value", ns);
+
+    count = 0;
+    start = now_ns();
+    do {
+        unsigned char * p = c.reply.buf;
+        unsigned char * end = c.reply.buf + c.reply.len;
+        while (p < end)
+            sum += get_uleb128(&p, end);
+        count += BENCH_VALUES;
+        ns = now_ns() - start;
+    } while (ns < BENCH_MIN_NS);
+    report("uleb128 decode", count, "value", ns);
+    if (sum == 0) printf("\n");
+    free(c.reply.buf);
+}
+
+static int bench_mix(const BenchMix * mix) {
+    static unsigned char batch[BENCH_BATCH];
+    static unsigned char drain[BENCH_BATCH];
+    XvcClient * c;
+    unsigned char * p = batch;
+    unsigned batch_len;
+    unsigned cmds = 0;
+    unsigned long count = 0;
+    double start;
+    double ns;
+    int sv[2];
+
+    while (p - batch < BENCH_BATCH - 512) {
+        p = mix->put(p);
+        cmds++;
+    }
+    batch_len = p - batch;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        perror("socketpair");
+        return -1;
+    }
+    set_nonblocking(sv[0]);
+    set_nonblocking(sv[1]);
+
+    c = (XvcClient *)calloc(1, sizeof *c);
+    c->fd = sv[0];
+    c->handlers = &bench_handlers;
+    c->events = EPOLLIN;
+    c->buf_max = BENCH_BATCH;
+    c->buf_size = BENCH_BATCH;
+    c->buf = ring_alloc(&c->buf_size);
+    if (c->buf == NULL) {
+        perror("ring_alloc");
+        return -1;
+    }
+    reply_buf_size(c, BENCH_BATCH);
+
+    start = now_ns();
+    do {
+        memcpy(c->buf + c->buf_start, batch, batch_len);
+        c->buf_len = batch_len;
+        if (read_packet(c) < 0 || c->buf_len != 0) {
+            fprintf(stderr, "mix %s: read_packet failed\n", mix->name);
+            return -1;
+        }
+        while (recv(sv[1], drain, sizeof drain, 0) > 0);
+        count += cmds;
+        ns = now_ns() - start;
+    } while (ns < BENCH_MIN_NS);
+    report(mix->name, count, "cmd", ns);
+
+    ring_free(c->buf, c->buf_size);
+    free(c->reply.buf);
+    free(c);
+    close(sv[0]);
+    close(sv[1]);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    unsigned i;
+
+    init_commands();
+    bench_decode();
+    bench_uleb128();
+    for (i = 0; i < sizeof mixes / sizeof mixes[0]; i++) {
+        if (bench_mix(&mixes[i]) < 0)
+            return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,649 @@
+/*********************************************************************
+ * Copyright (c) 2021 Xilinx, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **********************************************************************/
+
+/*
+ * xvc_load
+ *
+ * Load generator for XVC servers.  Every connection runs on its own
+ * thread and keeps up to <depth> commands in flight, picked at random
+ * from a weighted mix of shift:, mrd:, mwr:, idpc: and edpc:.  The
+ * throughput and the latency of each command, from the time it is
+ * written to the socket until its reply has been read, are reported as
+ * JSON on stdout.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/vm_sockets.h>
+
+#define LOAD_SUB_BITS 4
+#define LOAD_MAX_BITS 40
+#define LOAD_BUCKETS ((LOAD_MAX_BITS - LOAD_SUB_BITS + 1) << LOAD_SUB_BITS)
+#define LOAD_BUF_SIZE 0x40000
+
+typedef enum {
+    LOAD_SHIFT,
+    LOAD_MRD,
+    LOAD_MWR,
+    LOAD_IDPC,
+    LOAD_EDPC,
+    LOAD_COMMANDS
+} LoadCommand;
+
+static const char * load_names[LOAD_COMMANDS] = { "shift", "mrd", "mwr", "idpc", "edpc" };
+
+/* Log-linear latency histogram, as used by the server statistics */
+typedef struct {
+    uint64_t count;
+    uint64_t max;
+    uint64_t buckets[LOAD_BUCKETS];
+} LoadHistogram;
+
+typedef struct {
+    uint64_t commands;
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+    uint64_t errors;
+    LoadHistogram latency[LOAD_COMMANDS];
+} LoadStats;
+
+/* A command in flight, replies arrive in the order of the commands */
+typedef struct {
+    LoadCommand cmd;
+    unsigned reply_len;
+    /* Offset in the send buffer after the command */
+    unsigned end;
+    uint64_t start;
+} LoadPending;
+
+typedef struct {
+    pthread_t thread;
+    unsigned id;
+    int fd;
+    uint32_t seed;
+    LoadStats stats;
+    LoadPending * pending;
+    unsigned head;
+    unsigned tail;
+    unsigned char * out;
+    unsigned out_len;
+    unsigned out_sent;
+    unsigned char * in;
+    unsigned in_len;
+    int failed;
+} LoadConnection;
+
+static const char * url = "tcp:127.0.0.1:10200";
+static unsigned weights[LOAD_COMMANDS] = { 0, 6, 4, 0, 0 };
+static unsigned weight_total;
+static unsigned connections = 1;
+static unsigned depth = 16;
+static double duration = 5;
+static uint64_t count_limit = 0;
+static unsigned shift_bits = 256;
+static unsigned mem_bytes = 4;
+static uint64_t mem_addr = 0;
+static uint64_t mem_range = 0;
+static unsigned dpc_words = 16;
+static unsigned xvc_version = 11;
+static unsigned server_len;
+static unsigned command_max;
+static volatile int load_stop;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint32_t load_rand(LoadConnection * lc) {
+    lc->seed ^= lc->seed << 13;
+    lc->seed ^= lc->seed >> 17;
+    lc->seed ^= lc->seed << 5;
+    return lc->seed;
+}
+
+static unsigned histogram_bucket(uint64_t v) {
+    unsigned bits = 0;
+    if (v < (1u << LOAD_SUB_BITS)) return v;
+    while ((v >> bits) >= (2u << LOAD_SUB_BITS)) bits++;
+    if (bits + LOAD_SUB_BITS > LOAD_MAX_BITS) return LOAD_BUCKETS - 1;
+    return ((bits + 1) << LOAD_SUB_BITS) + (unsigned)((v >> bits) - (1u << LOAD_SUB_BITS));
+}
+
+static uint64_t histogram_value(unsigned bucket) {
+    unsigned bits = bucket >> LOAD_SUB_BITS;
+    uint64_t sub = bucket & ((1u << LOAD_SUB_BITS) - 1);
+    if (bits == 0) return sub;
+    return (((uint64_t)1 << LOAD_SUB_BITS) + sub) << (bits - 1);
+}
+
+static void histogram_add(LoadHistogram * h, uint64_t ns) {
+    h->buckets[histogram_bucket(ns)]++;
+    h->count++;
+    if (ns > h->max) h->max = ns;
+}
+
+static void histogram_merge(LoadHistogram * h, const LoadHistogram * from) {
+    unsigned i;
+    for (i = 0; i < LOAD_BUCKETS; i++)
+        h->buckets[i] += from->buckets[i];
+    h->count += from->count;
+    if (from->max > h->max) h->max = from->max;
+}
+
+static double histogram_percentile(const LoadHistogram * h, double q) {
+    uint64_t rank = (uint64_t)(h->count * q);
+    uint64_t seen = 0;
+    unsigned i;
+
+    if (h->count == 0) return 0;
+    if (rank >= h->count) return h->max / 1e3;
+    for (i = 0; i < LOAD_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen > rank) {
+            uint64_t v = histogram_value(i);
+            return (v < h->max ? v : h->max) / 1e3;
+        }
+    }
+    return h->max / 1e3;
+}
+
+static unsigned char * put_uleb128(unsigned char * p, uint64_t value) {
+    do {
+        *p++ = (value >= 0x80 ? 0x80 : 0) | (value & 0x7f);
+        value >>= 7;
+    } while (value);
+    return p;
+}
+
+static int get_uleb128(const unsigned char ** p, const unsigned char * end, uint64_t * value) {
+    unsigned shift = 0;
+    *value = 0;
+    while (*p < end) {
+        unsigned char b = *(*p)++;
+        *value |= (uint64_t)(b & 0x7f) << shift;
+        if ((b & 0x80) == 0) return 1;
+        shift += 7;
+    }
+    return 0;
+}
+
+static int connect_url(const char * spec) {
+    char * s = strdup(spec);
+    char * host;
+    char * port;
+    int fd = -1;
+
+    if (strncmp(s, "unix:", 5) == 0) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof addr);
+        addr.sun_family = AF_UNIX;
+        snprintf(addr.sun_path, sizeof addr.sun_path, "%s", s + 5);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof addr) < 0) {
+            close(fd);
+            fd = -1;
+        }
+    } else if (strncmp(s, "vsock:", 6) == 0 && (port = strchr(s + 6, ':')) != NULL) {
+        struct sockaddr_vm addr;
+        *port++ = '\0';
+        memset(&addr, 0, sizeof addr);
+        addr.svm_family = AF_VSOCK;
+        addr.svm_cid = strtoul(s + 6, NULL, 0);
+        addr.svm_port = strtoul(port, NULL, 0);
+        fd = socket(AF_VSOCK, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof addr) < 0) {
+            close(fd);
+            fd = -1;
+        }
+    } else {
+        struct addrinfo hints;
+        struct addrinfo * res;
+        struct addrinfo * ai;
+        int one = 1;
+
+        host = strncmp(s, "tcp:", 4) == 0 ? s + 4 : s;
+        port = strrchr(host, ':');
+        if (port == NULL) {
+            free(s);
+            errno = EINVAL;
+            return -1;
+        }
+        *port++ = '\0';
+        memset(&hints, 0, sizeof hints);
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(*host ? host : "127.0.0.1", port, &hints, &res) != 0) {
+            free(s);
+            errno = EHOSTUNREACH;
+            return -1;
+        }
+        for (ai = res; ai != NULL; ai = ai->ai_next) {
+            fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd < 0) continue;
+            if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(res);
+        if (fd >= 0)
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    }
+    free(s);
+    return fd;
+}
+
+/* Ask the server for its protocol version and vector length */
+static int load_getinfo(int fd, unsigned * version, unsigned * len) {
+    char info[64];
+    unsigned major;
+    unsigned minor;
+    unsigned n = 0;
+
+    if (send(fd, "getinfo:", 8, MSG_NOSIGNAL) != 8) return -1;
+    while (n < sizeof info - 1) {
+        if (recv(fd, info + n, 1, 0) != 1) return -1;
+        if (info[n++] == '\n') break;
+    }
+    info[n] = '\0';
+    if (sscanf(info, "xvcServer_v%u.%u:%u", &major, &minor, len) != 3) {
+        fprintf(stderr, "unexpected getinfo: reply %s\n", info);
+        return -1;
+    }
+    *version = major * 10 + minor;
+    return 0;
+}
+
+/* Append the next command of the mix to the send buffer */
+static void load_put(LoadConnection * lc) {
+    LoadPending * pc = lc->pending + lc->head % depth;
+    unsigned char * p = lc->out + lc->out_len;
+    unsigned pick = load_rand(lc) % weight_total;
+    LoadCommand cmd = LOAD_SHIFT;
+    uint64_t addr = mem_addr;
+
+    while (pick >= weights[cmd]) {
+        pick -= weights[cmd];
+        cmd++;
+    }
+    if (mem_range > mem_bytes)
+        addr += ((uint64_t)load_rand(lc) % (mem_range - mem_bytes + 1)) & ~(uint64_t)3;
+
+    switch (cmd) {
+    case LOAD_SHIFT: {
+        unsigned bytes = (shift_bits + 7) / 8;
+        memcpy(p, "shift:", 6);
+        p[6] = shift_bits;
+        p[7] = shift_bits >> 8;
+        p[8] = shift_bits >> 16;
+        p[9] = shift_bits >> 24;
+        memset(p + 10, 0, bytes);
+        memset(p + 10 + bytes, 0xa5, bytes);
+        p += 10 + 2 * bytes;
+        pc->reply_len = bytes;
+        break;
+    }
+    case LOAD_MRD:
+        memcpy(p, "mrd:", 4);
+        p = put_uleb128(p + 4, 0);
+        p = put_uleb128(p, addr);
+        p = put_uleb128(p, mem_bytes);
+        pc->reply_len = mem_bytes + 1;
+        break;
+    case LOAD_MWR:
+        memcpy(p, "mwr:", 4);
+        p = put_uleb128(p + 4, 0);
+        p = put_uleb128(p, addr);
+        p = put_uleb128(p, mem_bytes);
+        memset(p, 0x5a, mem_bytes);
+        p += mem_bytes;
+        pc->reply_len = 1;
+        break;
+    case LOAD_IDPC:
+        memcpy(p, "idpc:", 5);
+        p = put_uleb128(p + 5, 0);
+        p = put_uleb128(p, dpc_words);
+        memset(p, 0, dpc_words * 4);
+        p += dpc_words * 4;
+        pc->reply_len = 1;
+        break;
+    default:
+        memcpy(p, "edpc:", 5);
+        p = put_uleb128(p + 5, 0);
+        /* The length is only known from the reply */
+        pc->reply_len = 0;
+        break;
+    }
+    pc->cmd = cmd;
+    pc->start = 0;
+    lc->stats.bytes_sent += p - (lc->out + lc->out_len);
+    lc->out_len = p - lc->out;
+    pc->end = lc->out_len;
+    lc->head++;
+}
+
+/* Consume the complete replies at the start of the receive buffer */
+static int load_replies(LoadConnection * lc) {
+    const unsigned char * p = lc->in;
+    const unsigned char * end = lc->in + lc->in_len;
+    uint64_t now = now_ns();
+
+    while (lc->tail != lc->head) {
+        LoadPending * pc = lc->pending + lc->tail % depth;
+        unsigned len = pc->reply_len;
+        int status = 0;
+
+        if (pc->start == 0) break;
+        if (pc->cmd == LOAD_EDPC) {
+            const unsigned char * q = p;
+            uint64_t words;
+            if (!get_uleb128(&q, end, &words)) break;
+            len = (q - p) + words * 4 + 1;
+        }
+        if ((unsigned)(end - p) < len) break;
+        if (pc->cmd != LOAD_SHIFT) status = p[len - 1];
+        if (status != 0) {
+            lc->stats.errors++;
+            fprintf(stderr, "connection %u: %s: failed, check the addresses and sizes\n",
+                    lc->id, load_names[pc->cmd]);
+            return -1;
+        }
+        histogram_add(&lc->stats.latency[pc->cmd], now - pc->start);
+        lc->stats.commands++;
+        p += len;
+        lc->tail++;
+    }
+    memmove(lc->in, p, end - p);
+    lc->in_len = end - p;
+    return 0;
+}
+
+static void * load_thread(void * arg) {
+    LoadConnection * lc = (LoadConnection *)arg;
+    uint64_t sent = 0;
+    uint64_t stop = 0;
+
+    while (!load_stop || lc->tail != lc->head) {
+        struct pollfd pfd;
+
+        /* Wait for the replies in flight at the end for a few seconds */
+        if (load_stop && stop == 0)
+            stop = now_ns();
+        if (stop != 0 && now_ns() - stop > 5000000000ull) {
+            fprintf(stderr, "connection %u: no reply from the server\n", lc->id);
+            break;
+        }
+
+        /* Keep <depth> commands in flight */
+        while (!load_stop && lc->head - lc->tail < depth &&
+               lc->out_len + command_max <= LOAD_BUF_SIZE &&
+               (count_limit == 0 || sent < count_limit)) {
+            load_put(lc);
+            sent++;
+        }
+        if (count_limit != 0 && sent >= count_limit && lc->tail == lc->head) break;
+
+        pfd.fd = lc->fd;
+        pfd.events = POLLIN | (lc->out_sent < lc->out_len ? POLLOUT : 0);
+        if (poll(&pfd, 1, 100) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (pfd.revents & POLLOUT) {
+            ssize_t n = send(lc->fd, lc->out + lc->out_sent, lc->out_len - lc->out_sent,
+                             MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (n < 0 && errno != EAGAIN && errno != EINTR) break;
+            if (n > 0) {
+                uint64_t now = now_ns();
+                unsigned i;
+                lc->out_sent += n;
+                /* Commands are timed from when all of their bytes were sent */
+                for (i = lc->tail; i != lc->head; i++) {
+                    LoadPending * pc = lc->pending + i % depth;
+                    if (pc->start == 0 && pc->end <= lc->out_sent)
+                        pc->start = now;
+                }
+                if (lc->out_sent == lc->out_len)
+                    lc->out_sent = lc->out_len = 0;
+            }
+        }
+        if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t n = recv(lc->fd, lc->in + lc->in_len, LOAD_BUF_SIZE - lc->in_len, MSG_DONTWAIT);
+            if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+                fprintf(stderr, "connection %u: closed by the server\n", lc->id);
+                break;
+            }
+            if (n > 0) {
+                lc->in_len += n;
+                lc->stats.bytes_received += n;
+                if (load_replies(lc) < 0) break;
+            }
+        }
+    }
+    lc->failed = lc->tail != lc->head;
+    return NULL;
+}
+
+static int parse_mix(char * spec) {
+    char * item;
+
+    memset(weights, 0, sizeof weights);
+    for (item = strtok(spec, ","); item != NULL; item = strtok(NULL, ",")) {
+        char * eq = strchr(item, '=');
+        unsigned i;
+
+        if (eq != NULL) *eq++ = '\0';
+        for (i = 0; i < LOAD_COMMANDS; i++) {
+            if (strcmp(item, load_names[i]) == 0) break;
+        }
+        if (i == LOAD_COMMANDS) {
+            fprintf(stderr, "unknown command %s in --mix\n", item);
+            return -1;
+        }
+        weights[i] = eq != NULL ? strtoul(eq, NULL, 0) : 1;
+    }
+    return 0;
+}
+
+static void print_histogram(const char * name, const LoadHistogram * h, int last) {
+    printf("    \"%s\": { \"commands\": %llu, \"p50_us\": %.2f, \"p90_us\": %.2f, "
+           "\"p99_us\": %.2f, \"p999_us\": %.2f, \"max_us\": %.2f }%s\n",
+           name, (unsigned long long)h->count,
+           histogram_percentile(h, 0.5), histogram_percentile(h, 0.9),
+           histogram_percentile(h, 0.99), histogram_percentile(h, 0.999),
+           h->max / 1e3, last ? "" : ",");
+}
+
+static const char * usage_text =
+    "Usage: xvc_load [options]\n"
+    "  -s, --url <url>          Server url, tcp:<host>:<port>, unix:<path> or\n"
+    "                           vsock:<cid>:<port>.  Default: tcp:127.0.0.1:10200\n"
+    "  -m, --mix <cmd=weight,..> Command mix of shift, mrd, mwr, idpc and edpc.\n"
+    "                           Default: mrd=6,mwr=4\n"
+    "  -c, --connections <n>    Concurrent connections.  Default: 1\n"
+    "  -d, --depth <n>          Commands in flight per connection.  Default: 16\n"
+    "  -t, --time <seconds>     Test duration.  Default: 5\n"
+    "  -n, --count <n>          Commands per connection instead of a duration\n"
+    "  -b, --bits <n>           Bits per shift:.  Default: 256\n"
+    "  -z, --size <bytes>       Bytes per mrd: and mwr:.  Default: 4\n"
+    "  -a, --addr <address>     First address of mrd: and mwr:.  Default: 0\n"
+    "  -r, --range <bytes>      Spread mrd: and mwr: over this many bytes\n"
+    "  -w, --words <n>          Words per idpc:.  Default: 16\n";
+
+int main(int argc, char **argv) {
+    static const struct option options[] = {
+        { "url", required_argument, NULL, 's' },
+        { "mix", required_argument, NULL, 'm' },
+        { "connections", required_argument, NULL, 'c' },
+        { "depth", required_argument, NULL, 'd' },
+        { "time", required_argument, NULL, 't' },
+        { "count", required_argument, NULL, 'n' },
+        { "bits", required_argument, NULL, 'b' },
+        { "size", required_argument, NULL, 'z' },
+        { "addr", required_argument, NULL, 'a' },
+        { "range", required_argument, NULL, 'r' },
+        { "words", required_argument, NULL, 'w' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    LoadConnection * lcs;
+    LoadStats total;
+    LoadHistogram all;
+    uint64_t start;
+    double secs;
+    unsigned longest;
+    unsigned i;
+    int failed = 0;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "s:m:c:d:t:n:b:z:a:r:w:h", options, NULL)) != -1) {
+        switch (opt) {
+        case 's': url = optarg; break;
+        case 'm': if (parse_mix(optarg) < 0) return 1; break;
+        case 'c': connections = strtoul(optarg, NULL, 0); break;
+        case 'd': depth = strtoul(optarg, NULL, 0); break;
+        case 't': duration = strtod(optarg, NULL); break;
+        case 'n': count_limit = strtoull(optarg, NULL, 0); break;
+        case 'b': shift_bits = strtoul(optarg, NULL, 0); break;
+        case 'z': mem_bytes = strtoul(optarg, NULL, 0); break;
+        case 'a': mem_addr = strtoull(optarg, NULL, 0); break;
+        case 'r': mem_range = strtoull(optarg, NULL, 0); break;
+        case 'w': dpc_words = strtoul(optarg, NULL, 0); break;
+        default:
+            fputs(usage_text, opt == 'h' ? stdout : stderr);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    for (i = 0; i < LOAD_COMMANDS; i++)
+        weight_total += weights[i];
+    if (weight_total == 0 || connections == 0 || depth == 0 || shift_bits == 0) {
+        fputs(usage_text, stderr);
+        return 1;
+    }
+
+    lcs = (LoadConnection *)calloc(connections, sizeof *lcs);
+    for (i = 0; i < connections; i++) {
+        LoadConnection * lc = lcs + i;
+        unsigned version;
+        unsigned len;
+
+        lc->fd = connect_url(url);
+        if (lc->fd < 0) {
+            fprintf(stderr, "cannot connect to %s: %s\n", url, strerror(errno));
+            return 1;
+        }
+        if (load_getinfo(lc->fd, &version, &len) < 0) {
+            fprintf(stderr, "getinfo: failed on %s\n", url);
+            return 1;
+        }
+        xvc_version = version;
+        server_len = len;
+        lc->id = i;
+        lc->seed = 0x9e3779b9u * (i + 1);
+        lc->pending = (LoadPending *)calloc(depth, sizeof *lc->pending);
+        lc->out = (unsigned char *)malloc(LOAD_BUF_SIZE);
+        lc->in = (unsigned char *)malloc(LOAD_BUF_SIZE);
+    }
+
+    /* Every command must fit in the receive buffer of the server */
+    longest = 10 + (shift_bits + 7) / 8 * 2;
+    if (weights[LOAD_MRD] + weights[LOAD_MWR] + weights[LOAD_IDPC] + weights[LOAD_EDPC] &&
+            xvc_version < 11) {
+        fprintf(stderr, "the server speaks XVC %u.%u, which only has shift:\n",
+                xvc_version / 10, xvc_version % 10);
+        return 1;
+    }
+    if (weights[LOAD_MWR] && 4 + 3 * 10 + mem_bytes > longest)
+        longest = 4 + 3 * 10 + mem_bytes;
+    if (weights[LOAD_IDPC] && 5 + 2 * 10 + dpc_words * 4 > longest)
+        longest = 5 + 2 * 10 + dpc_words * 4;
+    if ((weights[LOAD_SHIFT] && longest > server_len) || longest > LOAD_BUF_SIZE / 2 ||
+            mem_bytes + 1 > LOAD_BUF_SIZE / 2) {
+        fprintf(stderr, "commands of %u bytes do not fit in the server buffer of %u bytes\n",
+                longest, server_len);
+        return 1;
+    }
+    command_max = longest;
+
+    start = now_ns();
+    for (i = 0; i < connections; i++)
+        pthread_create(&lcs[i].thread, NULL, load_thread, lcs + i);
+    if (count_limit == 0) {
+        struct timespec ts;
+        ts.tv_sec = (time_t)duration;
+        ts.tv_nsec = (long)((duration - ts.tv_sec) * 1e9);
+        nanosleep(&ts, NULL);
+        load_stop = 1;
+    }
+    memset(&total, 0, sizeof total);
+    memset(&all, 0, sizeof all);
+    for (i = 0; i < connections; i++) {
+        unsigned j;
+        pthread_join(lcs[i].thread, NULL);
+        failed |= lcs[i].failed;
+        total.commands += lcs[i].stats.commands;
+        total.bytes_sent += lcs[i].stats.bytes_sent;
+        total.bytes_received += lcs[i].stats.bytes_received;
+        total.errors += lcs[i].stats.errors;
+        for (j = 0; j < LOAD_COMMANDS; j++) {
+            histogram_merge(&total.latency[j], &lcs[i].stats.latency[j]);
+            histogram_merge(&all, &lcs[i].stats.latency[j]);
+        }
+        close(lcs[i].fd);
+    }
+    secs = (now_ns() - start) / 1e9;
+
+    printf("{\n");
+    printf("  \"url\": \"%s\",\n", url);
+    printf("  \"protocol\": \"%u.%u\",\n", xvc_version / 10, xvc_version % 10);
+    printf("  \"connections\": %u,\n", connections);
+    printf("  \"depth\": %u,\n", depth);
+    printf("  \"seconds\": %.3f,\n", secs);
+    printf("  \"commands\": %llu,\n", (unsigned long long)total.commands);
+    printf("  \"errors\": %llu,\n", (unsigned long long)total.errors);
+    printf("  \"commands_per_second\": %.0f,\n", total.commands / secs);
+    printf("  \"bytes_sent\": %llu,\n", (unsigned long long)total.bytes_sent);
+    printf("  \"bytes_received\": %llu,\n", (unsigned long long)total.bytes_received);
+    printf("  \"megabytes_per_second\": %.3f,\n", (total.bytes_sent + total.bytes_received) / secs / 1e6);
+    printf("  \"latency\": {\n");
+    print_histogram("all", &all, 0);
+    for (i = 0; i < LOAD_COMMANDS; i++) {
+        unsigned j;
+        int last = 1;
+        if (weights[i] == 0) continue;
+        for (j = i + 1; j < LOAD_COMMANDS; j++)
+            if (weights[j]) last = 0;
+        print_histogram(load_names[i], &total.latency[i], last);
+    }
+    printf("  }\n");
+    printf("}\n");
+    return failed || total.errors ? 2 : 0;
+}
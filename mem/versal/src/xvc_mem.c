@@ -29,8 +29,10 @@
 #include <sys/mman.h>
 #include <assert.h>
 #include "xvcserver.h"
+#include "xvc_probe.h"
 #include <unistd.h>
 #include <sys/time.h>
+#include <time.h>
 #include <errno.h>
 #include <pthread.h>
 
@@ -41,6 +43,15 @@
 #define ENABLE_SINGLE_WORD_RW
 #define DEFAULT_HUB_ADDR 0xA4000000
 #define DEFAULT_HUB_SIZE 0x200000
+
+/*
+ * mpoll: reads the word back to back for MPOLL_SPIN_US, then sleeps
+ * between reads, starting at MPOLL_SLEEP_MIN_US and doubling up to
+ * MPOLL_SLEEP_MAX_US.
+ */
+#define MPOLL_SPIN_US 50
+#define MPOLL_SLEEP_MIN_US 10
+#define MPOLL_SLEEP_MAX_US 1000
 #define BYTE_ALIGN(a) ((a + 7) / 8)
 #define BUF_ALIGN(a) ((((a) + 7) / 8) * 8)
 #define MIN(a, b) (a < b ? a : b)
@@ -55,6 +66,7 @@ typedef struct mem_region {
 typedef struct {
     XvcClient * c;
     mem_region hub;
+    unsigned open_count;
 } xvc_mem_t;
 
 LoggingMode log_mode = LOG_MODE_DEFAULT;
@@ -63,8 +75,14 @@ static const char * usage_text[] = {
   "Usage:\n Name      Description",
   "-------------------------------",
   "[--help]    Show help information",
-  "[-s]       Socket listening port and protocol.  Default: TCP::10200",
+  "[-s]       Socket listening port and protocol (tcp:, vsock:, unix: or shm:).  Default: TCP::10200",
   "[--addr]    Debug hub address.",
+  "[--packet_len] Receive buffer size advertised to clients. Default: 10000",
+  "[--pipeline]  Execute commands on a separate hardware thread",
+  "[--io_uring]  Use io_uring for socket I/O when available",
+  "[--metrics]   Serve command statistics on [<host>:]<port>",
+  "[--trace_file] Flight recorder dump file.  Default: /tmp/xvcserver.<pid>.trace",
+  "[--capture]   Record every command batch and its reply to a file",
   "[--verbose] Show additional messages during execution",
   "[--quiet]   Disable logging all non-error messages during execution",
   "\n",
@@ -81,6 +99,10 @@ static int open_port(void *client_data, XvcClient * c) {
 
     xvc_mem->c = c;
 
+    // The hub mapping is shared by all open connections
+    if (xvc_mem->open_count++ > 0)
+        return (0);
+
     // MMap hub address
     if ((mem_fd = open("/dev/mem", O_RDWR | O_SYNC)) < 0) {
         perror("Failed to open /dev/mem");
@@ -107,10 +129,23 @@ static int open_port(void *client_data, XvcClient * c) {
 static void close_port(void *client_data) {
     xvc_mem_t* xvc_mem = (xvc_mem_t*)client_data;
 
+    if (xvc_mem->open_count > 1) {
+        xvc_mem->open_count--;
+        return;
+    }
+    xvc_mem->open_count = 0;
+
     // Unmap hub
     if (xvc_mem->hub.buf && munmap((void *) xvc_mem->hub.buf, xvc_mem->hub.size)) {
         printf("Failed to unmap 0x%08lX\n", (unsigned long) xvc_mem->hub.buf);
     }
+    xvc_mem->hub.buf = NULL;
+}
+
+static void select_port(void *client_data, XvcClient * c) {
+    xvc_mem_t* xvc_mem = (xvc_mem_t*)client_data;
+
+    xvc_mem->c = c;
 }
 
 static void set_tck(void *client_data, unsigned long nsperiod, unsigned long *result) {
@@ -163,6 +198,7 @@ static void mrd(
         gettimeofday(&start, NULL);
     }
 
+    XVC_PROBE2(xvc_mem, hub__read__start, addr, num_bytes);
 #ifdef ENABLE_SINGLE_WORD_RW
     // Use single word reads if getting a "bus error" when using accesses unaligned to 64 bits
     size_t i;
@@ -173,6 +209,7 @@ static void mrd(
 #else 
     memcpy(buf, xvc_mem->hub.buf + (addr - xvc_mem->hub.addr), num_bytes);
 #endif
+    XVC_PROBE2(xvc_mem, hub__read__done, addr, num_bytes);
 
     if (log_mode == LOG_MODE_VERBOSE) {
         gettimeofday(&stop, NULL);
@@ -181,6 +218,28 @@ static void mrd(
     }
 }
 
+#ifndef ENABLE_SINGLE_WORD_RW
+static const unsigned char * mrd_direct(
+        void * client_data,
+        unsigned flags,
+        size_t addr,
+        size_t num_bytes) {
+    xvc_mem_t* xvc_mem = (xvc_mem_t*)client_data;
+
+    // Out of range reads are reported by mrd()
+    if (addr < xvc_mem->hub.addr || num_bytes > xvc_mem->hub.size ||
+            addr - xvc_mem->hub.addr > xvc_mem->hub.size - num_bytes)
+        return NULL;
+
+    if (log_mode == LOG_MODE_VERBOSE) {
+        fprintf(stdout, "INFO: Memory read addr 0x%08lX num_bytes %lu sent from hub\n",
+                (unsigned long) addr, (unsigned long) num_bytes);
+    }
+
+    return xvc_mem->hub.buf + (addr - xvc_mem->hub.addr);
+}
+#endif
+
 static void mwr(
         void * client_data,
         unsigned flags,
@@ -206,6 +265,7 @@ static void mwr(
         gettimeofday(&start, NULL);
     }
 
+    XVC_PROBE2(xvc_mem, hub__write__start, addr, num_bytes);
 #ifdef ENABLE_SINGLE_WORD_RW
     // Use single word writes if getting a "bus error" when using accesses unaligned to 64 bits
     size_t i;
@@ -215,6 +275,7 @@ static void mwr(
 #else
     memcpy(xvc_mem->hub.buf + (addr - xvc_mem->hub.addr), buf, num_bytes);
 #endif
+    XVC_PROBE2(xvc_mem, hub__write__done, addr, num_bytes);
 
     if (log_mode == LOG_MODE_VERBOSE) {
         gettimeofday(&stop, NULL);
@@ -223,6 +284,126 @@ static void mwr(
     }
 }
 
+static void mwrm(
+        void * client_data,
+        unsigned flags,
+        size_t addr,
+        size_t num_bytes,
+        unsigned char * buf,
+        unsigned char * mask_buf) {
+    xvc_mem_t* xvc_mem = (xvc_mem_t*)client_data;
+    struct timeval stop, start;
+    int ret = 0;
+
+    if (log_mode == LOG_MODE_VERBOSE) {
+        fprintf(stdout, "INFO: Memory masked write addr 0x%08lX num_bytes %lu\n",
+                (unsigned long) addr, (unsigned long) num_bytes);
+    }
+
+    if (addr < xvc_mem->hub.addr || num_bytes > xvc_mem->hub.size ||
+            addr - xvc_mem->hub.addr > xvc_mem->hub.size - num_bytes) {
+        xvcserver_set_error(xvc_mem->c, "Invalid arguments addr 0x%08lX num_bytes %lu\n",
+            (unsigned long) addr, (unsigned long) num_bytes);
+        return;
+    }
+#ifdef ENABLE_SINGLE_WORD_RW
+    // Whole words only, so that no mask bits come from past the buffers
+    if (((addr | num_bytes) & 3) != 0) {
+        xvcserver_set_error(xvc_mem->c, "Invalid arguments addr 0x%08lX num_bytes %lu\n",
+            (unsigned long) addr, (unsigned long) num_bytes);
+        return;
+    }
+#endif
+
+    if (log_mode == LOG_MODE_VERBOSE) {
+        gettimeofday(&start, NULL);
+    }
+
+    XVC_PROBE2(xvc_mem, hub__write__start, addr, num_bytes);
+#ifdef ENABLE_SINGLE_WORD_RW
+    // Words with no mask bits set are not accessed and words with all
+    // of them set are written without being read first
+    size_t i;
+    for (i = 0; i < num_bytes; i += 4) {
+        volatile uint32_t * word = (volatile uint32_t *)(xvc_mem->hub.buf + (addr + i - xvc_mem->hub.addr));
+        uint32_t mask = *(uint32_t *)(mask_buf + i);
+        uint32_t data = *(uint32_t *)(buf + i);
+        if (mask == 0) continue;
+        if (mask != 0xffffffff) data = (*word & ~mask) | (data & mask);
+        *word = data;
+    }
+#else
+    unsigned char * hub = xvc_mem->hub.buf + (addr - xvc_mem->hub.addr);
+    size_t i;
+    for (i = 0; i < num_bytes; i++) {
+        if (mask_buf[i] != 0xff)
+            buf[i] = (hub[i] & ~mask_buf[i]) | (buf[i] & mask_buf[i]);
+    }
+    memcpy(hub, buf, num_bytes);
+#endif
+    XVC_PROBE2(xvc_mem, hub__write__done, addr, num_bytes);
+
+    if (log_mode == LOG_MODE_VERBOSE) {
+        gettimeofday(&stop, NULL);
+        fprintf(stdout, "Mwrm 0x%08lX took %lu u-seconds with %lu bytes. Return value %d\n",
+            (unsigned long) addr, stop.tv_usec - start.tv_usec, (unsigned long) num_bytes, ret);
+    }
+}
+
+static unsigned long elapsed_us(struct timespec * start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000UL + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+static void mpoll(
+        void * client_data,
+        unsigned flags,
+        size_t addr,
+        uint32_t mask,
+        uint32_t value,
+        unsigned long timeout_us,
+        uint32_t * result,
+        unsigned long * elapsed) {
+    xvc_mem_t* xvc_mem = (xvc_mem_t*)client_data;
+    volatile uint32_t * word;
+    unsigned long sleep_us = MPOLL_SLEEP_MIN_US;
+    struct timespec start;
+
+    if (log_mode == LOG_MODE_VERBOSE) {
+        fprintf(stdout, "INFO: Memory poll addr 0x%08lX mask 0x%08X value 0x%08X timeout %lu u-seconds\n",
+                (unsigned long) addr, (unsigned) mask, (unsigned) value, timeout_us);
+    }
+
+    if (addr < xvc_mem->hub.addr || addr + 4 > xvc_mem->hub.addr + xvc_mem->hub.size || (addr & 3) != 0) {
+        xvcserver_set_error(xvc_mem->c, "Invalid arguments addr 0x%08lX\n", (unsigned long) addr);
+        return;
+    }
+
+    word = (volatile uint32_t *)(xvc_mem->hub.buf + (addr - xvc_mem->hub.addr));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    XVC_PROBE2(xvc_mem, hub__read__start, addr, 4);
+    for (;;) {
+        *result = *word;
+        *elapsed = elapsed_us(&start);
+        if ((*result & mask) == (value & mask) || *elapsed >= timeout_us)
+            break;
+        if (*elapsed >= MPOLL_SPIN_US) {
+            if (sleep_us > timeout_us - *elapsed)
+                sleep_us = timeout_us - *elapsed;
+            usleep(sleep_us);
+            sleep_us *= 2;
+            if (sleep_us > MPOLL_SLEEP_MAX_US)
+                sleep_us = MPOLL_SLEEP_MAX_US;
+        }
+    }
+    XVC_PROBE2(xvc_mem, hub__read__done, addr, 4);
+
+    if (log_mode == LOG_MODE_VERBOSE) {
+        fprintf(stdout, "Mpoll 0x%08lX took %lu u-seconds. Value 0x%08X\n",
+            (unsigned long) addr, *elapsed, (unsigned) *result);
+    }
+}
 
 static void display_banner() {
     fprintf(stdout, "\nDescription:\n");
@@ -258,7 +439,15 @@ XvcServerHandlers handlers = {
     NULL,
     NULL,
     mrd,
-    mwr
+    mwr,
+    select_port,
+#ifdef ENABLE_SINGLE_WORD_RW
+    NULL,
+#else
+    mrd_direct,
+#endif
+    mwrm,
+    mpoll
 };
 
 int main(int argc, char **argv) {
@@ -268,6 +457,7 @@ int main(int argc, char **argv) {
     int quiet = 0;
     int verbose = 0;
 
+    memset(&xvc_mem, 0, sizeof xvc_mem);
     xvc_mem.hub.addr = DEFAULT_HUB_ADDR;
     xvc_mem.hub.size = DEFAULT_HUB_SIZE;
 
@@ -284,6 +474,35 @@ int main(int argc, char **argv) {
                 return ERROR_INVALID_ARGUMENT;
             }
             xvc_mem.hub.addr = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--packet_len") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "option --packet_len requires an argument\n");
+                return ERROR_INVALID_ARGUMENT;
+            }
+            if (xvcserver_set_packet_len(strtoul(argv[++i], NULL, 0)) != NO_ERROR)
+                return ERROR_INVALID_ARGUMENT;
+        } else if (strcmp(argv[i], "--pipeline") == 0) {
+            xvcserver_set_pipeline(1);
+        } else if (strcmp(argv[i], "--io_uring") == 0) {
+            xvcserver_set_io_uring(1);
+        } else if (strcmp(argv[i], "--metrics") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "option --metrics requires an argument\n");
+                return ERROR_INVALID_ARGUMENT;
+            }
+            xvcserver_set_metrics(argv[++i]);
+        } else if (strcmp(argv[i], "--trace_file") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "option --trace_file requires an argument\n");
+                return ERROR_INVALID_ARGUMENT;
+            }
+            xvcserver_set_trace_file(argv[++i]);
+        } else if (strcmp(argv[i], "--capture") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "option --capture requires an argument\n");
+                return ERROR_INVALID_ARGUMENT;
+            }
+            xvcserver_set_capture_file(argv[++i]);
         } else if (strcmp(argv[i], "--verbose") == 0) {
             verbose = 1;
             if (quiet) {
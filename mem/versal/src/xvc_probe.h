@@ -0,0 +1,60 @@
+/*********************************************************************
+ * Copyright (c) 2021 Xilinx, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **********************************************************************/
+
+/*
+ * Static probe points
+ *
+ * The hot paths are marked with USDT probes that bpftrace, perf or
+ * SystemTap can attach to on a running server, for example
+ *
+ *   bpftrace -e 'usdt:./xvc_mem:xvcserver:mrd__start { @s[tid] = nsecs }
+ *                usdt:./xvc_mem:xvcserver:mrd__done { @ns = hist(nsecs - @s[tid]) }'
+ *
+ * A probe that is not attached is a single nop in the code.  The
+ * probes are built when <sys/sdt.h> (systemtap-sdt-dev) is found, or
+ * with -DXVC_USDT=1, and -DXVC_USDT=0 leaves them out.  "perf list
+ * sdt" or "readelf -n" lists the probes of a binary.
+ */
+
+#ifndef XVC_PROBE_H
+#define XVC_PROBE_H
+
+#ifndef XVC_USDT
+#  if defined(__has_include)
+#    if __has_include(<sys/sdt.h>)
+#      define XVC_USDT 1
+#    endif
+#  endif
+#endif
+
+#if XVC_USDT
+#include <sys/sdt.h>
+#define XVC_PROBE(provider, name) DTRACE_PROBE(provider, name)
+#define XVC_PROBE1(provider, name, a1) DTRACE_PROBE1(provider, name, a1)
+#define XVC_PROBE2(provider, name, a1, a2) DTRACE_PROBE2(provider, name, a1, a2)
+#define XVC_PROBE3(provider, name, a1, a2, a3) DTRACE_PROBE3(provider, name, a1, a2, a3)
+#define XVC_PROBE4(provider, name, a1, a2, a3, a4) DTRACE_PROBE4(provider, name, a1, a2, a3, a4)
+#define XVC_PROBE5(provider, name, a1, a2, a3, a4, a5) DTRACE_PROBE5(provider, name, a1, a2, a3, a4, a5)
+#else
+#define XVC_PROBE(provider, name) do {} while (0)
+#define XVC_PROBE1(provider, name, a1) do {} while (0)
+#define XVC_PROBE2(provider, name, a1, a2) do {} while (0)
+#define XVC_PROBE3(provider, name, a1, a2, a3) do {} while (0)
+#define XVC_PROBE4(provider, name, a1, a2, a3, a4) do {} while (0)
+#define XVC_PROBE5(provider, name, a1, a2, a3, a4, a5) do {} while (0)
+#endif
+
+#endif /* XVC_PROBE_H */
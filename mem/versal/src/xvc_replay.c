@@ -0,0 +1,429 @@
+/*********************************************************************
+ * Copyright (c) 2021 Xilinx, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **********************************************************************/
+
+/*
+ * xvc_replay
+ *
+ * Replays a session captured with "xvc_mem --capture <file>" through the
+ * protocol engine on the build host.  xvcserver.c is included directly,
+ * as in xvc_bench, and every recorded connection gets its own XvcClient
+ * that is fed the recorded batches as fast as read_packet() takes them.
+ * The handlers below run memory commands against a plain buffer and
+ * loop shift: data back; pass another XvcServerHandlers table to
+ * replay() to replay against it.
+ */
+
+#include "xvcserver.c"
+
+#include <time.h>
+
+#define REPLAY_MEM_SIZE 0x100000
+#define REPLAY_SOCKET_BUF 0x100000
+#define REPLAY_MAX_CLIENTS 0x10000
+
+typedef struct {
+    XvcClient * c;
+    int sv[2];
+    /* Recorded reply bytes not matched against the replay yet */
+    unsigned char * expect;
+    size_t expect_len;
+    size_t expect_max;
+    /* Replayed reply bytes not matched yet.  The chunks of a streamed
+     * mrd: can be sent ahead of the batches that recorded them. */
+    unsigned char * ahead;
+    size_t ahead_len;
+    size_t ahead_max;
+} ReplayConn;
+
+typedef struct {
+    unsigned long batches;
+    unsigned long commands;
+    unsigned long connections;
+    uint64_t request_bytes;
+    uint64_t reply_bytes;
+    uint64_t reply_diff;
+    uint64_t * ns;
+    uint64_t * recorded_ns;
+} ReplayResult;
+
+static unsigned char replay_mem[REPLAY_MEM_SIZE];
+static XvcClient * replay_client;
+static ReplayConn * conns[REPLAY_MAX_CLIENTS];
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int replay_open_port(void * client_data, XvcClient * c) {
+    return 0;
+}
+
+static void replay_close_port(void * client_data) {
+}
+
+static void replay_select_port(void * client_data, XvcClient * c) {
+    replay_client = c;
+}
+
+static void replay_set_tck(void * client_data, unsigned long nsperiod, unsigned long * result) {
+    *result = nsperiod;
+}
+
+static void replay_shift_tms_tdi(
+    void * client_data,
+    unsigned long bitcount,
+    unsigned char * tms_buf,
+    unsigned char * tdi_buf,
+    unsigned char * tdo_buf) {
+    memcpy(tdo_buf, tdi_buf, (bitcount + 7) / 8);
+}
+
+static unsigned char * replay_addr(size_t addr, size_t num_bytes) {
+    if (num_bytes > REPLAY_MEM_SIZE) {
+        xvcserver_set_error(replay_client, "Invalid arguments num_bytes %lu", (unsigned long)num_bytes);
+        return NULL;
+    }
+    return replay_mem + addr % (REPLAY_MEM_SIZE - num_bytes + 1);
+}
+
+static void replay_mrd(void * client_data, unsigned flags, size_t addr, size_t num_bytes, unsigned char * buf) {
+    unsigned char * mem = replay_addr(addr, num_bytes);
+    if (mem != NULL) memcpy(buf, mem, num_bytes);
+}
+
+static void replay_mwr(void * client_data, unsigned flags, size_t addr, size_t num_bytes, unsigned char * buf) {
+    unsigned char * mem = replay_addr(addr, num_bytes);
+    if (mem != NULL) memcpy(mem, buf, num_bytes);
+}
+
+static void replay_mwrm(void * client_data, unsigned flags, size_t addr, size_t num_bytes,
+                        unsigned char * buf, unsigned char * mask_buf) {
+    unsigned char * mem = replay_addr(addr, num_bytes);
+    size_t i;
+    if (mem == NULL) return;
+    for (i = 0; i < num_bytes; i++)
+        mem[i] = (mem[i] & ~mask_buf[i]) | (buf[i] & mask_buf[i]);
+}
+
+/* The recorded reply says how the wait ended, the replay does not wait */
+static void replay_mpoll(void * client_data, unsigned flags, size_t addr, uint32_t mask, uint32_t value,
+                         unsigned long timeout_us, uint32_t * result, unsigned long * elapsed_us) {
+    unsigned char * mem = replay_addr(addr, 4);
+    if (mem != NULL) memcpy(result, mem, 4);
+    *elapsed_us = 0;
+}
+
+static XvcServerHandlers replay_handlers = {
+    replay_open_port,
+    replay_close_port,
+    replay_set_tck,
+    replay_shift_tms_tdi,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    replay_mrd,
+    replay_mwr,
+    replay_select_port,
+    NULL,
+    replay_mwrm,
+    replay_mpoll
+};
+
+static ReplayConn * replay_connect(XvcServerHandlers * handlers, unsigned id) {
+    ReplayConn * rc = (ReplayConn *)calloc(1, sizeof *rc);
+    XvcClient * c = (XvcClient *)calloc(1, sizeof *c);
+    int size = REPLAY_SOCKET_BUF;
+    struct epoll_event ev;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, rc->sv) < 0) {
+        perror("socketpair");
+        return NULL;
+    }
+    set_nonblocking(rc->sv[0]);
+    set_nonblocking(rc->sv[1]);
+    setsockopt(rc->sv[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof size);
+    setsockopt(rc->sv[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof size);
+
+    c->fd = rc->sv[0];
+    c->id = id;
+    c->handlers = handlers;
+    c->events = EPOLLIN;
+    c->buf_max = max_packet_len;
+    c->buf_size = c->buf_max;
+    c->buf = ring_alloc(&c->buf_size);
+    if (c->buf == NULL) {
+        perror("ring_alloc");
+        return NULL;
+    }
+    reply_buf_size(c, c->buf_size);
+    memset(&ev, 0, sizeof ev);
+    ev.events = c->events;
+    ev.data.ptr = c;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c->fd, &ev);
+    if (handlers->open_port(NULL, c) < 0) {
+        fprintf(stderr, "connection %u: open_port failed\n", id);
+        return NULL;
+    }
+    rc->c = c;
+    return rc;
+}
+
+static void replay_disconnect(XvcClient * c, ReplayConn * rc) {
+    c->handlers->close_port(NULL);
+    close(rc->sv[0]);
+    close(rc->sv[1]);
+    ring_free(c->buf, c->buf_size);
+    free(c->reply.buf);
+    macro_free(c);
+    subscribe_free(c);
+    shadow_free(c);
+    free(c);
+    free(rc->expect);
+    free(rc->ahead);
+    free(rc);
+}
+
+/* Compare the replies received so far with the recorded ones */
+static void replay_compare(ReplayConn * rc, ReplayResult * res) {
+    size_t n = rc->ahead_len < rc->expect_len ? rc->ahead_len : rc->expect_len;
+    size_t i;
+
+    if (memcmp(rc->ahead, rc->expect, n) != 0) {
+        for (i = 0; i < n; i++)
+            res->reply_diff += rc->ahead[i] != rc->expect[i];
+    }
+    memmove(rc->expect, rc->expect + n, rc->expect_len - n);
+    rc->expect_len -= n;
+    memmove(rc->ahead, rc->ahead + n, rc->ahead_len - n);
+    rc->ahead_len -= n;
+}
+
+/* Read the replies and compare them with the recorded ones */
+static void replay_drain(ReplayConn * rc, ReplayResult * res) {
+    static unsigned char buf[REPLAY_SOCKET_BUF];
+    ssize_t len;
+
+    while ((len = recv(rc->sv[1], buf, sizeof buf, 0)) > 0) {
+        if (rc->ahead_len + len > rc->ahead_max) {
+            rc->ahead_max = (rc->ahead_len + len) * 2;
+            rc->ahead = (unsigned char *)realloc(rc->ahead, rc->ahead_max);
+        }
+        memcpy(rc->ahead + rc->ahead_len, buf, len);
+        rc->ahead_len += len;
+        replay_compare(rc, res);
+    }
+}
+
+/* Execute what the client has buffered until it needs more input */
+static int replay_run(ReplayConn * rc, ReplayResult * res) {
+    XvcClient * c = rc->c;
+
+    for (;;) {
+        unsigned len = c->buf_len;
+
+        if (reply_pending(c)) {
+            replay_drain(rc, res);
+            if (send_packet(c) < 0) return -1;
+            continue;
+        }
+        if (len == 0 && c->mrd_left == 0) return 0;
+        if (read_packet(c) < 0) return -1;
+        replay_drain(rc, res);
+        if (c->buf_len == len && !reply_pending(c)) return 0;
+    }
+}
+
+static int replay_batch(ReplayConn * rc, const XvcCaptureRecord * r, const unsigned char * data,
+                        ReplayResult * res) {
+    XvcClient * c = rc->c;
+    const unsigned char * req = data;
+    size_t left = r->request_len;
+
+    if (rc->expect_len + r->reply_len > rc->expect_max) {
+        rc->expect_max = (rc->expect_len + r->reply_len) * 2;
+        rc->expect = (unsigned char *)realloc(rc->expect, rc->expect_max);
+    }
+    memcpy(rc->expect + rc->expect_len, data + r->request_len, r->reply_len);
+    rc->expect_len += r->reply_len;
+    replay_compare(rc, res);
+
+    while (left > 0) {
+        size_t room = c->buf_size - c->buf_len;
+        size_t n = left < room ? left : room;
+
+        memcpy(c->buf + (c->buf_start + c->buf_len) % c->buf_size, req, n);
+        c->buf_len += n;
+        req += n;
+        left -= n;
+        if (replay_run(rc, res) < 0) return -1;
+        if (n == 0 && c->buf_len == c->buf_size) {
+            fprintf(stderr, "connection %u: command larger than the receive buffer\n", c->id);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Replay the capture at <data> of <size> bytes against <handlers>.
+ * Connections are opened when their first batch is replayed and closed
+ * at the end.
+ */
+static int replay(XvcServerHandlers * handlers, const unsigned char * data, size_t size,
+                  ReplayResult * res) {
+    const XvcCaptureHeader * h = (const XvcCaptureHeader *)data;
+    size_t pos = sizeof *h;
+    unsigned i;
+
+    if (size < sizeof *h || h->magic != XVC_CAPTURE_MAGIC || h->version != 1 ||
+            h->record_size != sizeof(XvcCaptureRecord)) {
+        fprintf(stderr, "not an XVC capture file\n");
+        return -1;
+    }
+    while (pos + sizeof(XvcCaptureRecord) <= size) {
+        XvcCaptureRecord r;
+        ReplayConn * rc;
+        double start;
+
+        memcpy(&r, data + pos, sizeof r);
+        pos += sizeof r;
+        if (pos + r.request_len + r.reply_len > size) break;
+        rc = conns[r.client];
+        if (rc == NULL) {
+            rc = conns[r.client] = replay_connect(handlers, r.client);
+            if (rc == NULL) return -1;
+            res->connections++;
+        }
+        start = now_ns();
+        if (replay_batch(rc, &r, data + pos, res) < 0) return -1;
+        res->ns[res->batches] = now_ns() - start;
+        res->recorded_ns[res->batches] = r.duration;
+        res->batches++;
+        res->commands += r.commands;
+        res->request_bytes += r.request_len;
+        res->reply_bytes += r.reply_len;
+        pos += r.request_len + r.reply_len;
+    }
+    for (i = 0; i < REPLAY_MAX_CLIENTS; i++) {
+        if (conns[i] != NULL) {
+            replay_drain(conns[i], res);
+            res->reply_diff += conns[i]->expect_len + conns[i]->ahead_len;
+            replay_disconnect(conns[i]->c, conns[i]);
+            conns[i] = NULL;
+        }
+    }
+    return 0;
+}
+
+static int cmp_u64(const void * a, const void * b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void report_latency(const char * name, uint64_t * ns, unsigned long count) {
+    if (count == 0) return;
+    qsort(ns, count, sizeof *ns, cmp_u64);
+    printf("%-18s p50 %8.1f us  p99 %8.1f us  max %8.1f us\n", name,
+           ns[count / 2] / 1e3, ns[count * 99 / 100] / 1e3, ns[count - 1] / 1e3);
+}
+
+static unsigned char * read_file(const char * name, size_t * size) {
+    FILE * f = fopen(name, "rb");
+    unsigned char * data;
+    long len;
+
+    if (f == NULL) return NULL;
+    fseek(f, 0, SEEK_END);
+    len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    data = (unsigned char *)malloc(len > 0 ? len : 1);
+    if (data != NULL && fread(data, 1, len, f) != (size_t)len) {
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    *size = len;
+    return data;
+}
+
+int main(int argc, char **argv) {
+    ReplayResult res;
+    unsigned char * data;
+    unsigned long max_batches;
+    unsigned repeat = 1;
+    size_t size;
+    double start;
+    double ns;
+    unsigned i;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        if (opt != 'n') {
+            fprintf(stderr, "Usage: %s [-n <repeat>] <capture file>\n", argv[0]);
+            return 1;
+        }
+        repeat = strtoul(optarg, NULL, 0);
+    }
+    if (optind + 1 != argc || repeat == 0) {
+        fprintf(stderr, "Usage: %s [-n <repeat>] <capture file>\n", argv[0]);
+        return 1;
+    }
+    data = read_file(argv[optind], &size);
+    if (data == NULL) {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    init_commands();
+    epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0) {
+        perror("epoll_create1");
+        return 1;
+    }
+    memset(&res, 0, sizeof res);
+    max_batches = (size / sizeof(XvcCaptureRecord) + 1) * repeat;
+    res.ns = (uint64_t *)malloc(max_batches * sizeof *res.ns);
+    res.recorded_ns = (uint64_t *)malloc(max_batches * sizeof *res.recorded_ns);
+
+    start = now_ns();
+    for (i = 0; i < repeat; i++) {
+        if (replay(&replay_handlers, data, size, &res) < 0)
+            return 1;
+    }
+    ns = now_ns() - start;
+
+    printf("%lu batches, %lu commands, %lu connections, %llu request bytes, %llu reply bytes\n",
+           res.batches, res.commands, res.connections,
+           (unsigned long long)res.request_bytes, (unsigned long long)res.reply_bytes);
+    printf("%.3f s, %.0f commands/s, %.1f MB/s\n", ns / 1e9,
+           res.commands * 1e9 / ns, (res.request_bytes + res.reply_bytes) * 1e3 / ns);
+    printf("%llu reply bytes differ from the recording\n", (unsigned long long)res.reply_diff);
+    report_latency("batch (recorded)", res.recorded_ns, res.batches);
+    report_latency("batch (replay)", res.ns, res.batches);
+#if XVC_STATS
+    {
+        static char text[STATS_TEXT_MAX];
+        stats_format(text, sizeof text);
+        fputs(text, stdout);
+    }
+#endif
+    return 0;
+}
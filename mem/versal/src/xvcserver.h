@@ -24,6 +24,8 @@
  * xvcserver_start() function.
  */
 
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -46,6 +48,105 @@ enum ReturnErrorCodes {
     ERROR_GETHOSTNAME_FAILED         = 6
 };
 
+/*
+ * Shared memory object of the shm:<name> transport, "/<name>" for
+ * shm_open().  The header is followed by the request ring at
+ * <req_offset> and the reply ring at <rep_offset>.  Ring heads and
+ * tails are free running byte counts, the byte at count <n> is at
+ * offset <n> % size in the ring.
+ *
+ * A client sets <client_pid> and moves <state> from XVC_SHM_IDLE to
+ * XVC_SHM_CONNECT, then waits for XVC_SHM_OPEN before writing
+ * commands.  It ends the session with XVC_SHM_CLOSE, and the server
+ * returns the segment to XVC_SHM_IDLE.  A session the server closes
+ * goes straight back to XVC_SHM_IDLE.
+ *
+ * After changing <state>, <req_head> or <rep_tail> the client
+ * increments <server_seq> and, when <server_wait> is set, wakes the
+ * server with FUTEX_WAKE on <server_seq>.  The server does the same
+ * with <client_seq> and <client_wait> after changing <state>,
+ * <req_tail> or <rep_head>.
+ */
+#define XVC_SHM_MAGIC 0x31637678
+
+enum XvcShmState {
+    XVC_SHM_IDLE    = 0,
+    XVC_SHM_CONNECT = 1,
+    XVC_SHM_OPEN    = 2,
+    XVC_SHM_CLOSE   = 3
+};
+
+typedef struct XvcShmHeader {
+    uint32_t magic;
+    uint32_t state;
+    uint32_t client_pid;
+    uint32_t req_offset;
+    uint32_t req_size;
+    uint32_t rep_offset;
+    uint32_t rep_size;
+    uint32_t req_head;
+    uint32_t req_tail;
+    uint32_t rep_head;
+    uint32_t rep_tail;
+    uint32_t server_seq;
+    uint32_t server_wait;
+    uint32_t client_seq;
+    uint32_t client_wait;
+} XvcShmHeader;
+
+/*
+ * Flight recorder file written on SIGUSR1 and when a connection fails:
+ * an XvcTraceHeader, <names_len> bytes of command names, one per line
+ * in the order of the <command> numbers, and <count> XvcTraceRecord
+ * entries, oldest first.  <total> counts all records since the server
+ * started.  The newest record may be incomplete when the signal
+ * arrived while it was being written.
+ */
+#define XVC_TRACE_MAGIC 0x54435658
+
+typedef struct XvcTraceHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;
+    uint32_t count;
+    uint32_t names_len;
+    uint64_t total;
+} XvcTraceHeader;
+
+typedef struct XvcTraceRecord {
+    uint64_t time;              /* CLOCK_MONOTONIC ns when the command completed */
+    uint32_t duration;          /* ns spent executing the command */
+    uint32_t bytes_in;          /* request bytes */
+    uint32_t bytes_out;         /* reply bytes */
+    uint16_t client;            /* connection number */
+    uint8_t command;            /* line of the command name */
+    uint8_t error;              /* 1 when an error was pending after the command */
+} XvcTraceRecord;
+
+/*
+ * Session capture file: an XvcCaptureHeader followed by one
+ * XvcCaptureRecord per batch of commands executed together, each
+ * followed by the <request_len> bytes of the commands as received and
+ * the <reply_len> bytes of their replies.  Batches of all connections
+ * are interleaved in execution order.
+ */
+#define XVC_CAPTURE_MAGIC 0x50435658
+
+typedef struct XvcCaptureHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;
+} XvcCaptureHeader;
+
+typedef struct XvcCaptureRecord {
+    uint64_t time;              /* CLOCK_MONOTONIC ns when the batch started */
+    uint32_t duration;          /* ns until the reply was complete */
+    uint32_t request_len;
+    uint32_t reply_len;
+    uint16_t client;            /* connection number */
+    uint16_t commands;          /* commands in the batch */
+} XvcCaptureRecord;
+
 /*
  * XVC server callback function table.
  */
@@ -149,6 +250,60 @@ typedef struct XvcServerHandlers {
         size_t addr,
         size_t num_bytes,
         unsigned char * buf);
+
+    /* Called before commands received on connection <c> are executed
+     * and before close_port() for that connection.  Several
+     * connections may be open at the same time, so the implementation
+     * should use <c> when reporting errors with xvcserver_set_error()
+     * until the next select_port() call.  This callback is optional
+     * and must be set to NULL when not implemented. */
+    void (*select_port)(
+        void * client_data, XvcClient * c);
+
+    /* Called when the mrd: command is received for a large read to
+     * get a pointer to the <num_bytes> at <addr>, so that the reply
+     * is sent straight from that memory instead of a copy made by
+     * mrd().  The memory is read while the reply is being sent, so
+     * this is only suitable for memory that can be read with ordinary
+     * loads of any width.  Returns NULL to fall back to mrd().  This
+     * callback is optional and must be set to NULL when not
+     * implemented. */
+    const unsigned char * (*mrd_direct)(
+        void * client_data,
+        unsigned flags,
+        size_t addr,
+        size_t num_bytes);
+
+    /* Called when the mwrm: command is received to replace the bits
+     * of the <num_bytes> at <addr> that are set in <mask_buf> with
+     * the same bits of <buf>, keeping the others.  The read, modify
+     * and write should be done without returning to the client, so
+     * that no other access to the same memory is issued in between.
+     * Both buffers may be modified.  This callback is optional and
+     * must be set to NULL when not implemented. */
+    void (*mwrm)(
+        void * client_data,
+        unsigned flags,
+        size_t addr,
+        size_t num_bytes,
+        unsigned char * buf,
+        unsigned char * mask_buf);
+
+    /* Called when the mpoll: command is received to read the 32-bit
+     * word at <addr> until the bits set in <mask> are equal to
+     * <value>, or for at most <timeout_us> microseconds.  <result> is
+     * set to the last value read and <elapsed_us> to the time spent.
+     * A timeout is not an error.  This callback is optional and must
+     * be set to NULL when not implemented. */
+    void (*mpoll)(
+        void * client_data,
+        unsigned flags,
+        size_t addr,
+        uint32_t mask,
+        uint32_t value,
+        unsigned long timeout_us,
+        uint32_t * result,
+        unsigned long * elapsed_us);
 } XvcServerHandlers;
 
 /*
@@ -159,12 +314,69 @@ void xvcserver_set_error(
     const char * fmt, ...);
 
 /*
- * Start XVC server listing for incomming connections on <url>.  This
- * function will wait indefinitely for incomming connections.  When a
- * connection is established this function will initiate callback
- * functions defined in <handlers>.  Each callback will be passed the
- * <client_data> argument given to this function in addition to other
- * callback specific arguments.
+ * Set the packet length advertised by getinfo: to new connections.
+ * A client can ask for a larger one with configure:packet_len=<bytes>.
+ * Returns ERROR_INVALID_ARGUMENT when <len> is out of range.
+ */
+int xvcserver_set_packet_len(
+    unsigned len);
+
+/*
+ * Enable the pipelined mode before calling xvcserver_start().  Commands
+ * are then executed by a separate hardware thread, so receiving and
+ * sending overlap with the handler callbacks.  All callbacks, including
+ * open_port() and close_port(), are made from that thread.
+ */
+void xvcserver_set_pipeline(
+    int enable);
+
+/*
+ * Use an io_uring event loop instead of epoll.  Sends and receives of
+ * all connections are then submitted in batches, one system call per
+ * loop iteration.  xvcserver_start() falls back to epoll when io_uring
+ * is not available or the pipelined mode is enabled.
+ */
+void xvcserver_set_io_uring(
+    int enable);
+
+/*
+ * Write the flight recorder to <path> instead of
+ * /tmp/xvcserver.<pid>.trace.  The most recent commands are always
+ * recorded, and the file is written when the process receives SIGUSR1
+ * and when a connection is terminated by an error.
+ */
+void xvcserver_set_trace_file(
+    const char * path);
+
+/*
+ * Capture every batch of commands and its reply to <path>, set before
+ * calling xvcserver_start().  NULL disables capturing. The file is
+ * replayed with xvc_replay.
+ */
+void xvcserver_set_capture_file(
+    const char * path);
+
+/*
+ * Serve the command statistics on <addr>, [<host>:]<port>, before
+ * calling xvcserver_start().  Each connection to the port gets the
+ * counters and latency percentiles also returned by the stats:
+ * command, as plain text, and is then closed.
+ */
+void xvcserver_set_metrics(
+    const char * addr);
+
+/*
+ * Start XVC server listing for incomming connections on <url>, which
+ * is tcp:<host>:<port> or <host>:<port>, vsock:<cid>:<port> for a
+ * virtual machine socket, unix:<path> for a Unix domain socket, or
+ * shm:<name> for a shared memory segment that serves one local client
+ * at a time.  This function will wait indefinitely for incomming
+ * connections.  When a connection is established this function will
+ * initiate callback functions defined in <handlers>.  Each callback
+ * will be passed the <client_data> argument given to this function in
+ * addition to other callback specific arguments.  Multiple connections
+ * are served from a single event loop, so callbacks are never called
+ * concurrently.
  */
 int xvcserver_start(
     const char * url,